@@ -21,10 +21,30 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <inttypes.h>
 #include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
 #include <htslib/sam.h>
+#include <htslib/bgzf.h>
+#include <htslib/hfile.h>
+#include <htslib/hts_endian.h>
 #include <htslib/faidx.h>
+#include <htslib/thread_pool.h>
 
 #define CONDAMAGE_VERSION "2"
 
@@ -45,6 +65,26 @@ typedef struct {
 
 	int fwd_only;
 	int rev_only;
+
+	int use_md; // reconstruct the reference from MD tags
+
+	char *bam_ofmt; // output format, from -O
+	int level; // output compression level
+
+	int nthreads; // additional threads for BGZF (de)compression
+	int parallel; // scan regions in parallel, using the bam index
+	size_t readahead; // bytes of input to read ahead of the scan
+
+	struct refmap_t *refmap; // mapped ref.fasta, if uncompressed
+	struct refcache_t *refcache; // decoded contigs, if ref.fasta isn't mapped
+	size_t refcache_size; // memory limit for the refcache
+	struct refarena_t *refarena; // preloaded small contigs
+	struct refarena_idx_t *refarena_idx; // refarena, by the input's tids
+	size_t preload; // maximum length of contigs to preload
+	int sparse; // fetch reference blocks under reads, not whole contigs
+	char *shm_name; // shared memory segment holding the packed reference
+
+	int njobs; // jobs to run at once, for `serve' and `batch', 0 if unset
 } opt_t;
 
 /*
@@ -91,660 +131,5807 @@ bam_hdr_append(bam_hdr_t *hdr, const char *line)
 }
 
 /*
- * Load reference sequence, if required.
+ * Classification of a pair of bases, indexed by the nt16 codes of
+ * the reference and read bases, (ref<<4 | read).
+ * Codes are A=1, C=2, G=4, T=8, so soft-masked (lower case) reference
+ * bases are treated the same as upper case bases.
  */
-static int
-get_refseq(char **ref, faidx_t *fai, bam_hdr_t *bam_hdr, int tid)
-{
-	static int ref_tid = -1;
-	static int ref_len = -1;
+enum {
+	BASE_C   = 1, // reference has C
+	BASE_G   = 2, // reference has G
+	BASE_C2T = 4, // reference has C, read has T
+	BASE_G2A = 8, // reference has G, read has A
+};
 
-	if (ref_tid != tid) {
-		if (*ref)
-			free(*ref);
-		*ref = NULL;
-		ref_len = faidx_seq_len(fai, bam_hdr->target_name[tid]);
-		if (ref_len == -1) {
-			fprintf(stderr, "bam has region `%s', which is not in fasta file\n",
-					bam_hdr->target_name[tid]);
-			return -1;
-		}
-		*ref = faidx_fetch_seq(fai, bam_hdr->target_name[tid], 0, ref_len, &ref_len);
-		if (*ref == NULL)
-			return -1;
-		ref_tid = tid;
-	}
+static const uint8_t nt16_class[256] = {
+	[2<<4 ... (2<<4|7)] = BASE_C,
+	[2<<4 | 8] = BASE_C | BASE_C2T,
+	[(2<<4|9) ... (2<<4|15)] = BASE_C,
+	[4<<4] = BASE_G,
+	[4<<4 | 1] = BASE_G | BASE_G2A,
+	[(4<<4|2) ... (4<<4|15)] = BASE_G,
+};
+
+#define NT16_CLASS(ref, read) nt16_class[(ref)<<4 | (read)]
+
+/*
+ * Memory mapped reference.  This is either the packed reference written
+ * by `condamage index' (see below), or an uncompressed fasta.  For fasta,
+ * the .fai gives the offset of each contig in the file, and its line
+ * structure, so any reference coordinate maps directly to a byte of the
+ * mapped file.  The mapping is read only, and shared by all threads (and,
+ * through the page cache, by all processes using the same reference).
+ */
+typedef struct {
+	char *name;
+	int64_t len; // contig length
+	int64_t offset; // file offset of the first base
+	int64_t line_blen; // bases per line (fasta)
+	int64_t line_len; // bytes per line, including the newline (fasta)
+	int64_t runs_offset; // file offset of the N runs (packed)
+	int64_t n_runs; // number of N runs (packed)
+} refmap_ctg_t;
+
+typedef struct refmap_t {
+	const uint8_t *base;
+	size_t size;
+	refmap_ctg_t *ctg; // sorted by name
+	int n_ctg;
+	int packed;
+} refmap_t;
+
+/*
+ * Packed reference file, `ref.fasta.c2b'.  All integers are little endian.
+ *
+ *   char magic[8] = "CDMG2BIT"
+ *   uint32_t version, n_ctg
+ *   uint64_t table_offset
+ *
+ * Followed by the data for each contig: the sequence packed 4 bases per
+ * byte, first base in the high bits, with A=0, C=1, G=2, T=3, and then
+ * the runs of bases that are not A, C, G or T, as (uint64_t beg, len)
+ * pairs sorted by beg.  Those bases are treated as N, and are stored
+ * as A in the packed sequence.  Finally, the contig table has one entry
+ * for each contig:
+ *
+ *   uint64_t len, seq_offset, runs_offset, n_runs
+ *   uint32_t l_name // including the NUL
+ *   char name[l_name]
+ */
+#define C2B_MAGIC "CDMG2BIT"
+#define C2B_VERSION 1
+#define C2B_HDR_LEN 24
+#define C2B_CTG_LEN 36 // contig table entry, excluding the name
 
-	return ref_len;
+static int
+refmap_ctg_cmp(const void *a, const void *b)
+{
+	return strcmp(((const refmap_ctg_t *)a)->name, ((const refmap_ctg_t *)b)->name);
 }
 
-int
-condamage(opt_t *opt)
+static void
+refmap_close(refmap_t *map)
 {
-	int i, j, k;
-	int ret;
+	int i;
 
-	samFile *bam_fp, *bam_ofp = NULL;
-	bam_hdr_t *bam_hdr, *bam_ohdr = NULL;
-	faidx_t *fai;
-	char *ref = NULL;
-	bam1_t *b;
+	if (map == NULL)
+		return;
+	for (i=0; i<map->n_ctg; i++)
+		free(map->ctg[i].name);
+	free(map->ctg);
+	if (map->base)
+		munmap((void *)map->base, map->size);
+	free(map);
+}
 
-	uint64_t *lhist, *lhist_cond; // fragment length counts
+/*
+ * Map the open file fd.
+ */
+static int
+refmap_mmap_fd(refmap_t *map, int fd)
+{
+	struct stat st;
 
-	enum {_5C2T=0, _3C2T, _5G2A, _3G2A};
-#define COND_5C2T (1<<_5C2T)
-#define COND_3C2T (1<<_3C2T)
-#define COND_5G2A (1<<_5G2A)
-#define COND_3G2A (1<<_3G2A)
+	if (fstat(fd, &st) < 0 || st.st_size == 0)
+		return -1;
+	map->size = st.st_size;
+	map->base = mmap(NULL, map->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map->base == MAP_FAILED) {
+		map->base = NULL;
+		return -1;
+	}
+	return 0;
+}
 
-	struct counts {
-		// unconditional
-		uint64_t c, c2t, g, g2a;
+/*
+ * Map the file fn.
+ */
+static int
+refmap_mmap(refmap_t *map, const char *fn)
+{
+	int fd, ret;
 
-		// conditional
-		struct {
-			uint64_t c, c2t, g, g2a;
-		} cond[4];
+	fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	ret = refmap_mmap_fd(map, fd);
+	close(fd);
+	return ret;
+}
 
-	} *counts5, // counts for the window towards the 5' end
-	  *counts3; // counts for the window towards the 3' end
+/*
+ * Map the packed reference in the open file fd, called fn in messages.
+ * If fd is -1, fn is opened instead.  Returns NULL on error.
+ */
+static refmap_t *
+refmap_open_packed_fd(int fd, const char *fn)
+{
+	refmap_t *map;
+	const uint8_t *p, *end;
+	uint32_t i;
 
-	counts5 = calloc(opt->window, sizeof(*counts5));
-	if (counts5 == NULL) {
-		perror("calloc:counts5");
-		ret = -1;
-		goto err0;
-	}
+	map = calloc(1, sizeof(*map));
+	if (map == NULL)
+		return NULL;
+	map->packed = 1;
 
-	counts3 = calloc(opt->window, sizeof(*counts3));
-	if (counts3 == NULL) {
-		perror("calloc:counts3");
-		ret = -2;
-		goto err1;
-	}
+	if ((fd < 0 ? refmap_mmap(map, fn) : refmap_mmap_fd(map, fd)) < 0
+			|| map->size < C2B_HDR_LEN
+			|| memcmp(map->base, C2B_MAGIC, 8) != 0
+			|| le_to_u32(map->base+8) != C2B_VERSION)
+		goto err;
 
-	lhist = calloc(opt->lmax, sizeof(*lhist));
-	if (lhist == NULL) {
-		perror("calloc:lhist");
-		ret = -3;
-		goto err2;
-	}
+	uint32_t n_ctg = le_to_u32(map->base+12);
+	uint64_t table_offset = le_to_u64(map->base+16);
+	if (table_offset > map->size)
+		goto err;
 
-	lhist_cond = calloc(opt->lmax, 4*sizeof(*lhist));
-	if (lhist_cond == NULL) {
-		perror("calloc:lhist_cond");
-		ret = -4;
-		goto err3;
-	}
+	map->ctg = calloc(n_ctg ? n_ctg : 1, sizeof(*map->ctg));
+	if (map->ctg == NULL)
+		goto err;
 
-	bam_fp = sam_open(opt->bam_fn, "r");
-	if (bam_fp == NULL) {
-		fprintf(stderr, "bam_open: %s: %s\n", opt->bam_fn, strerror(errno));
-		ret = -5;
-		goto err4;
+	p = map->base + table_offset;
+	end = map->base + map->size;
+	for (i=0; i<n_ctg; i++) {
+		refmap_ctg_t *c = &map->ctg[i];
+		if (end - p < C2B_CTG_LEN)
+			goto err;
+		c->len = le_to_u64(p);
+		c->offset = le_to_u64(p+8);
+		c->runs_offset = le_to_u64(p+16);
+		c->n_runs = le_to_u64(p+24);
+		uint32_t l_name = le_to_u32(p+32);
+		p += C2B_CTG_LEN;
+		if (l_name == 0 || end - p < l_name || p[l_name-1] != '\0'
+				|| c->len < 0 || c->offset < 0 || c->runs_offset < 0 || c->n_runs < 0
+				|| (uint64_t)c->offset + (c->len+3)/4 > map->size
+				|| (uint64_t)c->runs_offset + 16*(uint64_t)c->n_runs > map->size)
+			goto err;
+		c->name = strdup((const char *)p);
+		if (c->name == NULL)
+			goto err;
+		map->n_ctg++;
+		p += l_name;
 	}
+	qsort(map->ctg, map->n_ctg, sizeof(*map->ctg), refmap_ctg_cmp);
 
-	bam_hdr = sam_hdr_read(bam_fp);
-	if (bam_hdr == NULL) {
-		fprintf(stderr, "%s: couldn't read header\n", opt->bam_fn);
-		ret = -6;
-		goto err5;
-	}
+	return map;
+err:
+	fprintf(stderr, "%s: invalid packed reference, try `condamage index' again\n", fn);
+	refmap_close(map);
+	return NULL;
+}
 
-	fai = fai_load(opt->fasta_fn);
-	if (fai == NULL) {
-		ret = -7;
-		goto err6;
-	}
+/*
+ * Map the packed reference c2b_fn.  Returns NULL on error.
+ */
+static refmap_t *
+refmap_open_packed(const char *c2b_fn)
+{
+	return refmap_open_packed_fd(-1, c2b_fn);
+}
 
-	b = bam_init1();
-	if (b == NULL) {
-		ret = -8;
-		goto err7;
-	}
+/*
+ * Map fasta_fn, using its .fai.  Returns NULL if the fasta is compressed,
+ * or can't otherwise be mapped.
+ */
+static refmap_t *
+refmap_open_fasta(const char *fasta_fn)
+{
+	refmap_t *map;
+	char fn[4096];
+	char *line = NULL;
+	size_t m_line = 0;
+	FILE *fai;
+	int m_ctg = 0;
 
-	if (opt->bam_ofn) {
-		bam_ofp = sam_open(opt->bam_ofn, "w");
-		if (bam_ofp == NULL) {
-			fprintf(stderr, "bam_open: %s: %s\n", opt->bam_ofn, strerror(errno));
-			ret = -9;
-			goto err8;
-		}
+	// bgzipped fasta has a .gzi
+	snprintf(fn, sizeof(fn), "%s.gzi", fasta_fn);
+	if (access(fn, F_OK) == 0)
+		return NULL;
 
-		bam_ohdr = bam_hdr_dup(bam_hdr);
-		if (bam_ohdr == NULL) {
-			/*
-			 * XXX: bam_hdr_dup doesn't properly check for
-			 * allocation failures, so we'll crash before
-			 * getting here.
-			 */
-			fprintf(stderr, "bam_hdr_dup: failed to allocate memory: %s\n", strerror(errno));
-			ret = -10;
-			goto err9;
-		}
+	map = calloc(1, sizeof(*map));
+	if (map == NULL)
+		return NULL;
 
-#define BUFLEN 8096
-		char pgbuf[BUFLEN];
-		int offs = snprintf(pgbuf, BUFLEN, "@PG\tID:condamage\tPN:condamage\tVN:%s\tCL:", CONDAMAGE_VERSION);
-		for (i=0; i<opt->argc && offs < BUFLEN-1; i++)
-			offs += snprintf(pgbuf+offs, BUFLEN-offs, "%s%s", i==0?"":" ", opt->argv[i]);
+	snprintf(fn, sizeof(fn), "%s.fai", fasta_fn);
+	fai = fopen(fn, "r");
+	if (fai == NULL)
+		goto err0;
 
-		if (bam_hdr_append(bam_ohdr, pgbuf) < 0) {
-			ret = -11;
-			goto err10;
-		}
+	while (getline(&line, &m_line, fai) > 0) {
+		char name[4096];
+		refmap_ctg_t c;
 
-		if (sam_hdr_write(bam_ofp, bam_ohdr) < 0) {
-			fprintf(stderr, "sam_hdr_write: %s: %s\n", opt->bam_ofn, strerror(errno));
-			ret = -12;
-			goto err10;
+		if (sscanf(line, "%4095s\t%" SCNd64 "\t%" SCNd64 "\t%" SCNd64 "\t%" SCNd64,
+					name, &c.len, &c.offset, &c.line_blen, &c.line_len) != 5
+				|| c.len < 0 || c.offset < 0 || c.line_blen <= 0
+				|| c.line_len < c.line_blen)
+			goto err1;
+		if (map->n_ctg == m_ctg) {
+			m_ctg = m_ctg ? m_ctg*2 : 64;
+			refmap_ctg_t *tmp = realloc(map->ctg, m_ctg * sizeof(*tmp));
+			if (tmp == NULL)
+				goto err1;
+			map->ctg = tmp;
 		}
+		c.name = strdup(name);
+		if (c.name == NULL)
+			goto err1;
+		map->ctg[map->n_ctg++] = c;
 	}
+	qsort(map->ctg, map->n_ctg, sizeof(*map->ctg), refmap_ctg_cmp);
 
-	while (1) {
-		int r = sam_read1(bam_fp, bam_hdr, b);
-		if (r < 0) {
-			if (r == -1)
-				break;
-			fprintf(stderr, "sam_read1: %s: read failed\n", opt->bam_ofn);
-			ret = -13;
-			goto err10;
-		}
-		bam1_core_t *c = &b->core;
-
-		if (c->flag & (BAM_FUNMAP|BAM_FQCFAIL|BAM_FDUP|
-				BAM_FSECONDARY|BAM_FSUPPLEMENTARY))
-			// skip these
-			continue;
+	if (refmap_mmap(map, fasta_fn) < 0)
+		goto err1;
 
-		if (c->flag & BAM_FPAIRED)
-			continue;
+	// gzipped, rather than bgzipped, fasta can't be indexed,
+	// but check the magic anyway
+	if (map->size >= 2 && map->base[0] == 0x1f && map->base[1] == 0x8b)
+		goto err1;
 
-		if (opt->fwd_only && bam_is_rev(b))
-			continue;
+	free(line);
+	fclose(fai);
+	return map;
+err1:
+	free(line);
+	fclose(fai);
+err0:
+	refmap_close(map);
+	return NULL;
+}
 
-		if (opt->rev_only && !bam_is_rev(b))
-			continue;
+/*
+ * Map the reference for fasta_fn.  The packed reference, ref.fasta.c2b,
+ * is used if it exists and is up to date.  Otherwise an uncompressed
+ * fasta is mapped using its .fai.  Returns NULL if neither is possible,
+ * in which case faidx should be used.
+ */
+static refmap_t *
+refmap_open(const char *fasta_fn)
+{
+	struct stat st_fa, st_c2b;
+	char c2b_fn[4096];
 
-		int op;
-		int x, // offset in ref
-		    y; // offset in query seq
-		char c1, c2;
+	snprintf(c2b_fn, sizeof(c2b_fn), "%s.c2b", fasta_fn);
+	if (stat(c2b_fn, &st_c2b) == 0) {
+		if (stat(fasta_fn, &st_fa) == 0 && st_fa.st_mtime > st_c2b.st_mtime)
+			fprintf(stderr, "%s is older than %s, ignoring it\n", c2b_fn, fasta_fn);
+		else
+			return refmap_open_packed(c2b_fn);
+	}
 
-		int hclip = 0;
-		int b_out = 0;
-		int cond = 0;
+	return refmap_open_fasta(fasta_fn);
+}
 
-		uint8_t *seq = bam_get_seq(b);
-		uint32_t *cigar = bam_get_cigar(b);
-		int ref_len = get_refseq(&ref, fai, bam_hdr, c->tid);
+static int c2b_write_fp(FILE *fp, faidx_t *fai);
 
-		if (ref_len == -1) {
-			ret = -14;
-			goto err10;
-		}
+#define SHM_WAIT 600 // seconds to wait for another process to publish
 
-		if (bam_endpos(b) > ref_len) {
-			fprintf(stderr, "%s: read mapped outside the reference sequence: bam/ref mismatch?\n",
-					bam_get_qname(b));
-			continue;
-		}
+/*
+ * Write the packed reference for fasta_fn to the new shared memory
+ * segment fd.  The header's magic is written last, marking it complete.
+ */
+static int
+refmap_publish(int fd, const char *shm_name, const char *fasta_fn)
+{
+	faidx_t *fai;
+	FILE *fp;
+	int fd2, ret = -1;
 
-		// check for mismatch at left most position
-		op = bam_cigar_op(cigar[0]);
-		if (op==BAM_CMATCH || op==BAM_CEQUAL || op==BAM_CDIFF) {
-			c1 = seq_nt16_str[bam_seqi(seq, 0)];
-			c2 = ref[c->pos];
+	fai = fai_load(fasta_fn);
+	if (fai == NULL) {
+		fprintf(stderr, "%s: couldn't load fasta index\n", fasta_fn);
+		goto err0;
+	}
+	fd2 = dup(fd);
+	if (fd2 < 0 || (fp = fdopen(fd2, "w")) == NULL) {
+		fprintf(stderr, "%s: %s\n", shm_name, strerror(errno));
+		if (fd2 >= 0)
+			close(fd2);
+		goto err1;
+	}
+	ret = c2b_write_fp(fp, fai);
+	if (fclose(fp) != 0)
+		ret = -1;
+	if (ret < 0)
+		fprintf(stderr, "%s: write failed\n", shm_name);
+err1:
+	fai_destroy(fai);
+err0:
+	return ret;
+}
 
-			if (c2 == 'C' && c1 == 'T') {
-				if (bam_is_rev(b))
-					cond |= COND_3G2A;
-				else
-					cond |= COND_5C2T;
-			}
+/*
+ * Attach to the packed reference in POSIX shared memory segment shm_name,
+ * read only.  If the segment doesn't exist, this process publishes it
+ * from fasta_fn.  Other processes started at the same time wait for the
+ * publisher to finish.  Returns NULL on error.
+ */
+static refmap_t *
+refmap_open_shm(const char *shm_name, const char *fasta_fn)
+{
+	refmap_t *map;
+	char magic[8];
+	struct stat st;
+	int fd, t;
 
-			if (c2 == 'G' && c1 == 'A') {
-				if (bam_is_rev(b))
-					cond |= COND_3C2T;
-				else
-					cond |= COND_5G2A;
-			}
+	fd = shm_open(shm_name, O_RDWR|O_CREAT|O_EXCL, 0644);
+	if (fd >= 0) {
+		fprintf(stderr, "%s: publishing %s\n", shm_name, fasta_fn);
+		if (refmap_publish(fd, shm_name, fasta_fn) < 0) {
+			shm_unlink(shm_name);
+			close(fd);
+			return NULL;
 		}
-
-		// check for mismatch at right most position
-		op = bam_cigar_op(cigar[c->n_cigar-1]);
-		if (op==BAM_CMATCH || op==BAM_CEQUAL || op==BAM_CDIFF) {
-			c1 = seq_nt16_str[bam_seqi(seq, c->l_qseq-1)];
-			c2 = ref[bam_endpos(b)-1];
-
-			if (c2 == 'G' && c1 == 'A') {
-				if (bam_is_rev(b))
-					cond |= COND_5C2T;
-				else
-					cond |= COND_3G2A;
-			}
-
-			if (c2 == 'C' && c1 == 'T') {
-				if (bam_is_rev(b))
-					cond |= COND_5G2A;
-				else
-					cond |= COND_3C2T;
+	} else if (errno == EEXIST) {
+		fd = shm_open(shm_name, O_RDONLY, 0);
+		if (fd < 0) {
+			fprintf(stderr, "%s: %s\n", shm_name, strerror(errno));
+			return NULL;
+		}
+		for (t=0; ; t++) {
+			if (pread(fd, magic, 8, 0) == 8 && memcmp(magic, C2B_MAGIC, 8) == 0)
+				break;
+			// the publisher unlinks the segment if it fails
+			if (fstat(fd, &st) < 0 || st.st_nlink == 0 || t == SHM_WAIT) {
+				fprintf(stderr, "%s: segment wasn't published, remove it and try again\n",
+						shm_name);
+				close(fd);
+				return NULL;
 			}
+			sleep(1);
 		}
+	} else {
+		fprintf(stderr, "%s: %s\n", shm_name, strerror(errno));
+		return NULL;
+	}
 
-		for (i = y = 0, x = c->pos; i < c->n_cigar; ++i) {
-			int op = bam_cigar_op(cigar[i]);
-			int l = bam_cigar_oplen(cigar[i]);
+	map = refmap_open_packed_fd(fd, shm_name);
+	close(fd);
+	return map;
+}
 
-			if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
-				for (j = 0; j < l; ++j) {
-					int z1 = y + j;
-					int z2 = c->l_qseq - (z1 + 1);
+/*
+ * Find the contig called name.
+ */
+static const refmap_ctg_t *
+refmap_find(const refmap_t *map, const char *name)
+{
+	refmap_ctg_t key;
 
+	key.name = (char *)name;
+	return bsearch(&key, map->ctg, map->n_ctg, sizeof(*map->ctg), refmap_ctg_cmp);
+}
 
-					if (z1>=opt->window && z2>=opt->window)
-						continue;
+/*
+ * Check that the contigs of bam_hdr have the same lengths in map, as a
+ * shared segment could have been published from a different reference.
+ */
+static int
+refmap_check_hdr(const refmap_t *map, bam_hdr_t *bam_hdr, const char *map_name)
+{
+	int tid;
 
-					c1 = seq_nt16_str[bam_seqi(seq, z1)];
-					c2 = ref[x+j];
+	for (tid=0; tid<bam_hdr->n_targets; tid++) {
+		const refmap_ctg_t *ctg = refmap_find(map, bam_hdr->target_name[tid]);
+		if (ctg && ctg->len != bam_hdr->target_len[tid]) {
+			fprintf(stderr, "`%s' has length %"PRIu32" in the bam header, but %"PRId64" in %s\n",
+					bam_hdr->target_name[tid], bam_hdr->target_len[tid],
+					ctg->len, map_name);
+			return -1;
+		}
+	}
+	return 0;
+}
 
-// update counts
-#define c_update(cnt, z, var) \
-	do { \
-		unsigned k; \
-		cnt[z].var++; \
-		for (k=0; k<4; k++) { \
-			if (cond & (1<<k)) \
-				cnt[z].cond[k].var++; \
-		} \
-	} while (0)
+/*
+ * Ask the kernel to read contig ctg in the background, so the scan
+ * doesn't stall on page faults when it reaches the contig.
+ */
+static void
+refmap_willneed(const refmap_t *map, const refmap_ctg_t *ctg)
+{
+	size_t pg = sysconf(_SC_PAGESIZE);
+	size_t beg = ctg->offset, end;
 
-					// ref has C
-					if (c2 == 'C') {
-
-						if (bam_is_rev(b)) {
-							if (z1 < opt->window) {
-								c_update(counts3, z1, g);
-							} else if (z2 < opt->window) {
-								c_update(counts5, z2, g);
-							}
-						} else {
-							if (z1 < opt->window) {
-								c_update(counts5, z1, c);
-							} else if (z2 < opt->window) {
-								c_update(counts3, z2, c);
-							}
-						}
-
-						// read has T: C->T for fwd reads, G->A for rev reads
-						if (c1 == 'T') {
-							if (bam_is_rev(b)) {
-								if (z1 < opt->window) {
-									c_update(counts3, z1, g2a);
-								} else if (z2 < opt->window) {
-									c_update(counts5, z2, g2a);
-								}
-								if (z1 < opt->g3)
-									b_out = 1;
-								if (z2 < opt->g5)
-									b_out = 1;
-							} else {
-								if (z1 < opt->window) {
-									c_update(counts5, z1, c2t);
-								} else if (z2 < opt->window) {
-									c_update(counts3, z2, c2t);
-								}
-								if (z1 < opt->c5)
-									b_out = 1;
-								if (z2 < opt->c3)
-									b_out = 1;
-							}
-						}
-					}
+	if (map->packed)
+		end = ctg->runs_offset + 16*ctg->n_runs;
+	else if (ctg->line_blen > 0)
+		end = ctg->offset + ctg->len / ctg->line_blen * ctg->line_len
+			+ ctg->len % ctg->line_blen;
+	else
+		return;
+	if (end > map->size)
+		end = map->size;
+	beg &= ~(pg-1);
+	if (beg < end)
+		madvise((void *)(map->base + beg), end - beg, MADV_WILLNEED);
+}
 
-					// ref has G
-					if (c2 == 'G') {
-
-						if (bam_is_rev(b)) {
-							if (z1 < opt->window) {
-								c_update(counts3, z1, c);
-							} else if (z2 < opt->window) {
-								c_update(counts5, z2, c);
-							}
-						} else {
-							if (z1 < opt->window) {
-								c_update(counts5, z1, g);
-							} else if (z2 < opt->window) {
-								c_update(counts3, z2, g);
-							}
-						}
-
-						// read has A: G->A for fwd reads, C->T for rev reads
-						if (c1 == 'A') {
-							if (bam_is_rev(b)) {
-								if (z1 < opt->window) {
-									c_update(counts3, z1, c2t);
-								} else if (z2 < opt->window) {
-									c_update(counts5, z2, c2t);
-								}
-								if (z1 < opt->c3)
-									b_out = 1;
-								if (z2 < opt->c5)
-									b_out = 1;
-							} else {
-								if (z1 < opt->window) {
-									c_update(counts5, z1, g2a);
-								} else if (z2 < opt->window) {
-									c_update(counts3, z2, g2a);
-								}
-								if (z1 < opt->g5)
-									b_out = 1;
-								if (z2 < opt->g3)
-									b_out = 1;
-							}
-						}
-					}
+/*
+ * Copy bases [beg,end) of a packed contig into buf, nt16 encoded.
+ */
+static void
+refmap_fetch_packed(const refmap_t *map, const refmap_ctg_t *ctg, int64_t beg, int64_t end,
+		uint8_t *buf)
+{
+	static const uint8_t nt2_nt16[4] = {1, 2, 4, 8};
+	const uint8_t *seq = map->base + ctg->offset;
+	const uint8_t *runs = map->base + ctg->runs_offset;
+	int64_t x, lo, hi;
 
-				}
-				x += l;
-				y += l;
-
-			} else if (op == BAM_CSOFT_CLIP || op == BAM_CINS) {
-				y += l;
-			} else if (op == BAM_CREF_SKIP || op == BAM_CDEL) {
-				x += l;
-			} else if (op == BAM_CHARD_CLIP) {
-				hclip += l;
-			}
+	for (x=beg; x<end; x++)
+		buf[x-beg] = nt2_nt16[seq[x>>2] >> (6 - 2*(x&3)) & 3];
 
-		}
+	// find the first run that ends after beg
+	lo = 0;
+	hi = ctg->n_runs;
+	while (lo < hi) {
+		int64_t mid = lo + (hi - lo) / 2;
+		const uint8_t *r = runs + 16*mid;
+		if (le_to_u64(r) + le_to_u64(r+8) <= (uint64_t)beg)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-		if (bam_ofp && b_out) {
-			if (sam_write1(bam_ofp, bam_ohdr, b) < 0) {
-				fprintf(stderr, "sam_write1: %s: write failed\n", opt->bam_ofn);
-				ret = -15;
-				goto err10;
-			}
-		}
+	for (; lo < ctg->n_runs; lo++) {
+		const uint8_t *r = runs + 16*lo;
+		int64_t rbeg = le_to_u64(r);
+		int64_t rend = rbeg + le_to_u64(r+8);
+		if (rbeg >= end)
+			break;
+		for (x = rbeg > beg ? rbeg : beg; x < rend && x < end; x++)
+			buf[x-beg] = 15; // N
+	}
+}
 
-		y += hclip;
+/*
+ * Copy bases [beg,end) of contig ctg into buf, nt16 encoded.
+ * Returns -1 if the contig's lines extend past the end of the file.
+ */
+static int
+refmap_fetch(const refmap_t *map, const refmap_ctg_t *ctg, int64_t beg, int64_t end,
+		uint8_t *buf)
+{
+	int64_t x = beg;
 
-		if (y < opt->lmax) {
-			lhist[y]++;
-			for (k=0; k<4; k++) {
-				if (cond & (1<<k))
-					lhist_cond[y<<2 | k]++;
-			}
-		}
+	if (map->packed) {
+		refmap_fetch_packed(map, ctg, beg, end, buf);
+		return 0;
+	}
 
+	while (x < end) {
+		int64_t col = x % ctg->line_blen;
+		int64_t n = ctg->line_blen - col;
+		if (n > end - x)
+			n = end - x;
+		int64_t off = ctg->offset + x / ctg->line_blen * ctg->line_len + col;
+		if (off + n > (int64_t)map->size)
+			return -1;
+		const uint8_t *p = map->base + off;
+		int64_t i;
+		for (i=0; i<n; i++)
+			buf[i] = seq_nt16_table[p[i]];
+		buf += n;
+		x += n;
 	}
 
-	printf("#condamage version %s\n", CONDAMAGE_VERSION);
-	printf("#cmdline:");
-	for (i=0; i<opt->argc; i++)
-		printf(" %s", opt->argv[i]);
-	printf("\n\n");
+	return 0;
+}
 
-	// unconditional stats
-	printf("#C2T5\ti\tmm\tn\n");
-	printf("# C2T5  C to T mismatches towards the 5' end\n");
-	printf("# i     distance from 5' end\n");
-	printf("# mm    number of mismatches\n");
-	printf("# n     matches+mismatches (ref has C)\n\n");
-	for (i=0; i<opt->window; i++)
-		printf("C2T5\t%d\t%jd\t%jd\n", i+1, (uintmax_t)counts5[i].c2t, (uintmax_t)counts5[i].c);
-	printf("\n");
-
-	printf("#C2T3\ti\tmm\tn\n");
-	printf("# C2T3  C to T mismatches towards the 3' end\n");
-	printf("# i     distance from 3' end\n");
-	printf("# mm    number of mismatches\n");
-	printf("# n     matches+mismatches (ref has C)\n\n");
-	for (i=0; i<opt->window; i++)
-		printf("C2T3\t%d\t%jd\t%jd\n", i+1, (uintmax_t)counts3[i].c2t, (uintmax_t)counts3[i].c);
-	printf("\n");
-
-	printf("#G2A5\ti\tmm\tn\n");
-	printf("# G2A5  G to A mismatches towards the 5' end\n");
-	printf("# i     distance from 5' end\n");
-	printf("# mm    number of mismatches\n");
-	printf("# n     matches+mismatches (ref has G)\n\n");
-	for (i=0; i<opt->window; i++)
-		printf("G2A5\t%d\t%jd\t%jd\n", i+1, (uintmax_t)counts5[i].g2a, (uintmax_t)counts5[i].g);
-	printf("\n");
-
-	printf("#G2A3\ti\tmm\tn\n");
-	printf("# G2A3  G to A mismatches towards the 3' end\n");
-	printf("# i     distance from 3' end\n");
-	printf("# mm    number of mismatches\n");
-	printf("# n     matches+mismatches (ref has G)\n\n");
-	for (i=0; i<opt->window; i++)
-		printf("G2A3\t%d\t%jd\t%jd\n", i+1, (uintmax_t)counts3[i].g2a, (uintmax_t)counts3[i].g);
-	printf("\n");
+/*
+ * Cache of decoded contigs, used when ref.fasta can't be mapped (e.g. it
+ * is bgzipped).  Input that isn't sorted by position changes contig on
+ * nearly every read, and without the cache each change would decode a
+ * whole chromosome.  The cache is shared by all threads.  Contigs in use
+ * are pinned by their refcount, and the least recently used of the rest
+ * are evicted to keep the total under the -c limit.
+ */
+typedef struct refent_t {
+	char *name;
+	uint8_t *seq; // nt16 encoded, NULL until loaded
+	int len;
+	int ref; // number of users
+	int loading; // being fetched by the first user
+	int failed;
+	struct refent_t *hnext; // hash chain
+	struct refent_t *prev, *next; // lru list, most recently used first
+} refent_t;
 
+typedef struct refcache_t {
+	pthread_mutex_t lock;
+	pthread_cond_t loaded;
+	refent_t **hash;
+	size_t n_hash, n_ent;
+	refent_t *head, *tail;
+	size_t size; // bytes of decoded sequence
+	size_t max_size;
 
-	// conditional stats
-	int win;
-	for (win=0; win<2; win++) {
-		char ch_win = "53"[win];
-		struct counts *cnts;
+	// prefetch thread, loading the contig after the one last loaded
+	pthread_t pf_thread;
+	pthread_cond_t pf_cond;
+	faidx_t *pf_fai;
+	char *pf_name; // next contig to load, or NULL
+	int pf_stop;
+} refcache_t;
 
-		if (win == 0)
-			cnts = counts5;
-		else
-			cnts = counts3;
+#define REFCACHE_NHASH 64
 
-		for (k=0; k<4; k++) {
-			char *str_cond = ((char *[]){"5C2T", "3C2T", "5G2A", "3G2A"})[k];
+static size_t
+refcache_hash(const char *name)
+{
+	size_t h = 2166136261u;
+	while (*name)
+		h = (h ^ (uint8_t)*name++) * 16777619u;
+	return h;
+}
 
-			printf("#C2T%c|%s\ti\tmm\tn\n", ch_win, str_cond);
-			printf("# C2T%c|%s  C to T mismatches towards the %c' end,\n", ch_win, str_cond, ch_win);
-			printf("#            conditional on a %c to %c mismatch at the most %c' position\n", str_cond[1], str_cond[3], str_cond[0]);
-			for (i=0; i<opt->window; i++)
-				printf("C2T%c|%s\t%d\t%jd\t%jd\n", ch_win, str_cond, i+1, (uintmax_t)cnts[i].cond[k].c2t, (uintmax_t)cnts[i].cond[k].c);
-			printf("\n");
+static refcache_t *
+refcache_init(size_t max_size)
+{
+	refcache_t *c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		goto err0;
+	c->n_hash = REFCACHE_NHASH;
+	c->hash = calloc(c->n_hash, sizeof(*c->hash));
+	if (c->hash == NULL)
+		goto err1;
+	c->max_size = max_size;
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->loaded, NULL);
+	return c;
+err1:
+	free(c);
+err0:
+	fprintf(stderr, "refcache_init: failed to allocate memory\n");
+	return NULL;
+}
 
-			printf("#G2A%c|%s\ti\tmm\tn\n", ch_win, str_cond);
-			printf("# G2A%c|%s  G to A mismatches towards the %c' end,\n", ch_win, str_cond, ch_win);
-			printf("#            conditional on a %c to %c mismatch at the most %c' position\n", str_cond[1], str_cond[3], str_cond[0]);
-			for (i=0; i<opt->window; i++)
-				printf("G2A%c|%s\t%d\t%jd\t%jd\n", ch_win, str_cond, i+1, (uintmax_t)cnts[i].cond[k].g2a, (uintmax_t)cnts[i].cond[k].g);
-			printf("\n");
-		}
+static void
+refent_free(refent_t *e)
+{
+	free(e->name);
+	free(e->seq);
+	free(e);
+}
+
+static void
+refcache_destroy(refcache_t *c)
+{
+	refent_t *e, *next;
+
+	if (c == NULL)
+		return;
+	if (c->pf_fai) {
+		pthread_mutex_lock(&c->lock);
+		c->pf_stop = 1;
+		pthread_cond_signal(&c->pf_cond);
+		pthread_mutex_unlock(&c->lock);
+		pthread_join(c->pf_thread, NULL);
+		pthread_cond_destroy(&c->pf_cond);
+		fai_destroy(c->pf_fai);
+		free(c->pf_name);
 	}
+	for (e=c->head; e; e=next) {
+		next = e->next;
+		refent_free(e);
+	}
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->loaded);
+	free(c->hash);
+	free(c);
+}
 
-	// fragment length histograms
-	int lmax;
+static void
+refcache_lru_unlink(refcache_t *c, refent_t *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		c->head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		c->tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void
+refcache_lru_push(refcache_t *c, refent_t *e)
+{
+	e->prev = NULL;
+	e->next = c->head;
+	if (c->head)
+		c->head->prev = e;
+	else
+		c->tail = e;
+	c->head = e;
+}
+
+/*
+ * Remove an entry from the hash table and the lru list.
+ * It's freed by its last user.
+ */
+static void
+refcache_unlink(refcache_t *c, refent_t *e)
+{
+	refent_t **pp = &c->hash[refcache_hash(e->name) & (c->n_hash-1)];
+
+	while (*pp != e)
+		pp = &(*pp)->hnext;
+	*pp = e->hnext;
+	refcache_lru_unlink(c, e);
+	c->size -= e->len;
+	c->n_ent--;
+}
+
+/*
+ * Double the hash table when it gets crowded.  Failure to grow is harmless.
+ */
+static void
+refcache_grow(refcache_t *c)
+{
+	size_t i, n_hash = c->n_hash * 2;
+	refent_t **hash, *e, *next;
+
+	hash = calloc(n_hash, sizeof(*hash));
+	if (hash == NULL)
+		return;
+	for (i=0; i<c->n_hash; i++) {
+		for (e=c->hash[i]; e; e=next) {
+			size_t h = refcache_hash(e->name) & (n_hash-1);
+			next = e->hnext;
+			e->hnext = hash[h];
+			hash[h] = e;
+		}
+	}
+	free(c->hash);
+	c->hash = hash;
+	c->n_hash = n_hash;
+}
+
+/*
+ * Evict unused contigs, least recently used first, until under the limit.
+ */
+static void
+refcache_evict(refcache_t *c)
+{
+	refent_t *e = c->tail, *prev;
+
+	for (; e && c->size > c->max_size; e=prev) {
+		prev = e->prev;
+		if (e->ref == 0 && !e->loading) {
+			refcache_unlink(c, e);
+			refent_free(e);
+		}
+	}
+}
+
+/*
+ * Get the decoded contig `name', loading it with fai if it isn't cached.
+ * If another thread is already loading it, wait for that thread.
+ * The contig stays pinned until released with refcache_put().
+ */
+static refent_t *
+refcache_get(refcache_t *c, faidx_t *fai, const char *name)
+{
+	refent_t *e;
+	size_t h;
+
+	pthread_mutex_lock(&c->lock);
+	h = refcache_hash(name) & (c->n_hash-1);
+	for (e=c->hash[h]; e; e=e->hnext) {
+		if (strcmp(e->name, name) == 0)
+			break;
+	}
+
+	if (e) {
+		e->ref++;
+		while (e->loading)
+			pthread_cond_wait(&c->loaded, &c->lock);
+		if (e->failed) {
+			if (--e->ref == 0)
+				refent_free(e);
+			e = NULL;
+		} else {
+			refcache_lru_unlink(c, e);
+			refcache_lru_push(c, e);
+		}
+		pthread_mutex_unlock(&c->lock);
+		return e;
+	}
+
+	e = calloc(1, sizeof(*e));
+	if (e == NULL || (e->name = strdup(name)) == NULL) {
+		pthread_mutex_unlock(&c->lock);
+		fprintf(stderr, "refcache_get: failed to allocate memory\n");
+		free(e);
+		return NULL;
+	}
+	e->ref = 1;
+	e->loading = 1;
+	e->hnext = c->hash[h];
+	c->hash[h] = e;
+	refcache_lru_push(c, e);
+	if (++c->n_ent > c->n_hash)
+		refcache_grow(c);
+	pthread_mutex_unlock(&c->lock);
+
+	// load without holding the lock, so other contigs can still be used
+	uint8_t *seq = NULL;
+	int i, len = faidx_seq_len(fai, name);
+	if (len == -1) {
+		fprintf(stderr, "bam has region `%s', which is not in fasta file\n", name);
+	} else {
+		seq = (uint8_t *)faidx_fetch_seq(fai, name, 0, len, &len);
+		if (seq) {
+			for (i=0; i<len; i++)
+				seq[i] = seq_nt16_table[seq[i]];
+		}
+	}
+
+	pthread_mutex_lock(&c->lock);
+	e->loading = 0;
+	if (seq == NULL) {
+		e->failed = 1;
+		refcache_unlink(c, e);
+		if (--e->ref == 0)
+			refent_free(e);
+		e = NULL;
+	} else {
+		e->seq = seq;
+		e->len = len;
+		c->size += len;
+		refcache_evict(c);
+	}
+	pthread_cond_broadcast(&c->loaded);
+	pthread_mutex_unlock(&c->lock);
+
+	return e;
+}
+
+static void
+refcache_put(refcache_t *c, refent_t *e)
+{
+	pthread_mutex_lock(&c->lock);
+	e->ref--;
+	refcache_evict(c);
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void *
+refcache_prefetch_run(void *arg)
+{
+	refcache_t *c = arg;
+	refent_t *e;
+	char *name;
+
+	pthread_mutex_lock(&c->lock);
+	for (;;) {
+		while (c->pf_name == NULL && !c->pf_stop)
+			pthread_cond_wait(&c->pf_cond, &c->lock);
+		if (c->pf_stop)
+			break;
+		name = c->pf_name;
+		c->pf_name = NULL;
+		pthread_mutex_unlock(&c->lock);
+
+		/*
+		 * Contigs without reads needn't be in the fasta, so only
+		 * load what's there.  Errors are left for the scan to report,
+		 * if it turns out the contig is needed.
+		 */
+		if (faidx_has_seq(c->pf_fai, name)) {
+			e = refcache_get(c, c->pf_fai, name);
+			if (e)
+				refcache_put(c, e);
+		}
+		free(name);
+		pthread_mutex_lock(&c->lock);
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return NULL;
+}
+
+/*
+ * Start a thread to load contigs ahead of the scan, with its own handle
+ * on fasta_fn.  Sorted input otherwise stalls at each change of contig,
+ * while the next one is loaded.  Prefetching is pointless if the cache
+ * can't hold another contig, so is skipped with -c 0.
+ */
+static void
+refcache_prefetch_start(refcache_t *c, const char *fasta_fn)
+{
+	if (c->max_size == 0)
+		return;
+	c->pf_fai = fai_load(fasta_fn);
+	if (c->pf_fai == NULL)
+		return;
+	pthread_cond_init(&c->pf_cond, NULL);
+
+	// leave signals to the other threads, see serve()
+	sigset_t set, oset;
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	if (pthread_create(&c->pf_thread, NULL, refcache_prefetch_run, c) != 0) {
+		pthread_cond_destroy(&c->pf_cond);
+		fai_destroy(c->pf_fai);
+		c->pf_fai = NULL;
+	}
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+}
+
+/*
+ * Ask the prefetch thread to load contig `name'.  This replaces any
+ * request it hasn't yet started on.
+ */
+static void
+refcache_prefetch(refcache_t *c, const char *name)
+{
+	char *tmp;
+
+	if (c->pf_fai == NULL || (tmp = strdup(name)) == NULL)
+		return;
+	pthread_mutex_lock(&c->lock);
+	free(c->pf_name);
+	c->pf_name = tmp;
+	pthread_cond_signal(&c->pf_cond);
+	pthread_mutex_unlock(&c->lock);
+}
+/*
+ * Small contigs, decoded into a single block of memory when the reference
+ * is opened, and shared by every input scanned against it.  Assemblies
+ * with many thousands of scaffolds change contig at nearly every read,
+ * which would otherwise cost a name lookup, and possibly a load, each time.
+ */
+typedef struct {
+	char *name;
+	int64_t off; // offset in seq
+	int64_t len;
+} refarena_ctg_t;
+
+typedef struct refarena_t {
+	uint8_t *seq; // nt16 encoded
+	refarena_ctg_t *ctg; // sorted by name
+	int n_ctg;
+} refarena_t;
+
+/*
+ * The arena's contigs for one input, indexed by the input's tids.
+ */
+typedef struct refarena_idx_t {
+	const uint8_t *seq; // the arena's
+	int64_t *off; // offset of contig tid in seq, or -1 if not preloaded
+	int64_t *len;
+	int n_targets;
+} refarena_idx_t;
+
+static int
+refarena_ctg_cmp(const void *a, const void *b)
+{
+	const refarena_ctg_t *c1 = a, *c2 = b;
+	return strcmp(c1->name, c2->name);
+}
+
+static void
+refarena_destroy(refarena_t *a)
+{
+	int i;
+
+	if (a == NULL)
+		return;
+	for (i=0; i<a->n_ctg; i++)
+		free(a->ctg[i].name);
+	free(a->ctg);
+	free(a->seq);
+	free(a);
+}
+
+/*
+ * Preload the contigs of the reference that are no longer than max_len,
+ * from the mapped reference if there is one, else with faidx.
+ * Returns NULL on error.
+ */
+static refarena_t *
+refarena_load(const opt_t *opt, size_t max_len)
+{
+	refarena_t *a;
+	faidx_t *fai = NULL;
+	size_t size = 0;
+	int i, n;
+
+	a = calloc(1, sizeof(*a));
+	if (a == NULL)
+		goto err0;
+
+	if (opt->refmap == NULL) {
+		fai = fai_load(opt->fasta_fn);
+		if (fai == NULL)
+			goto err2;
+	}
+
+	n = opt->refmap ? opt->refmap->n_ctg : faidx_nseq(fai);
+	a->ctg = malloc((n ? n : 1) * sizeof(*a->ctg));
+	if (a->ctg == NULL)
+		goto err1;
+
+	for (i=0; i<n; i++) {
+		const char *name;
+		int64_t len;
+
+		if (opt->refmap) {
+			name = opt->refmap->ctg[i].name;
+			len = opt->refmap->ctg[i].len;
+		} else {
+			name = faidx_iseq(fai, i);
+			len = faidx_seq_len(fai, name);
+		}
+		if (len < 0 || (size_t)len > max_len)
+			continue;
+
+		refarena_ctg_t *c = &a->ctg[a->n_ctg];
+		c->name = strdup(name);
+		if (c->name == NULL)
+			goto err1;
+		c->off = size;
+		c->len = len;
+		a->n_ctg++;
+		size += len;
+	}
+
+	a->seq = malloc(size ? size : 1);
+	if (a->seq == NULL)
+		goto err1;
+
+	for (i=0; i<a->n_ctg; i++) {
+		refarena_ctg_t *c = &a->ctg[i];
+		uint8_t *seq = a->seq + c->off;
+		int j, len;
+
+		if (opt->refmap) {
+			const refmap_ctg_t *ctg = refmap_find(opt->refmap, c->name);
+			if (refmap_fetch(opt->refmap, ctg, 0, ctg->len, seq) < 0) {
+				fprintf(stderr, "`%s' is truncated, or doesn't match its .fai\n", c->name);
+				goto err2;
+			}
+		} else {
+			char *s = faidx_fetch_seq(fai, c->name, 0, c->len, &len);
+			if (s == NULL || len != c->len) {
+				free(s);
+				goto err2;
+			}
+			for (j=0; j<len; j++)
+				seq[j] = seq_nt16_table[(uint8_t)s[j]];
+			free(s);
+		}
+	}
+
+	qsort(a->ctg, a->n_ctg, sizeof(*a->ctg), refarena_ctg_cmp);
+
+	if (fai)
+		fai_destroy(fai);
+	return a;
+err1:
+	fprintf(stderr, "refarena_load: failed to allocate memory\n");
+err2:
+	if (fai)
+		fai_destroy(fai);
+	refarena_destroy(a);
+	return NULL;
+err0:
+	fprintf(stderr, "refarena_load: failed to allocate memory\n");
+	return NULL;
+}
+
+static void
+refarena_idx_destroy(refarena_idx_t *ai)
+{
+	if (ai == NULL)
+		return;
+	free(ai->off);
+	free(ai->len);
+	free(ai);
+}
+
+/*
+ * Look up the contigs of bam_hdr in the arena a.  Returns NULL on error.
+ */
+static refarena_idx_t *
+refarena_idx_init(const refarena_t *a, bam_hdr_t *bam_hdr)
+{
+	refarena_idx_t *ai;
+	int tid;
+
+	ai = calloc(1, sizeof(*ai));
+	if (ai == NULL)
+		goto err0;
+	ai->seq = a->seq;
+	ai->n_targets = bam_hdr->n_targets;
+	ai->off = malloc((ai->n_targets ? ai->n_targets : 1) * sizeof(*ai->off));
+	ai->len = malloc((ai->n_targets ? ai->n_targets : 1) * sizeof(*ai->len));
+	if (ai->off == NULL || ai->len == NULL)
+		goto err1;
+
+	for (tid=0; tid<ai->n_targets; tid++) {
+		refarena_ctg_t key, *c;
+
+		key.name = bam_hdr->target_name[tid];
+		c = bsearch(&key, a->ctg, a->n_ctg, sizeof(*a->ctg), refarena_ctg_cmp);
+		ai->off[tid] = c ? c->off : -1;
+		ai->len[tid] = c ? c->len : -1;
+	}
+
+	return ai;
+err1:
+	refarena_idx_destroy(ai);
+err0:
+	fprintf(stderr, "refarena_idx_init: failed to allocate memory\n");
+	return NULL;
+}
+
+/*
+ * A block of contig sequence, for -R.  Low coverage samples touch only a
+ * small part of each contig, so rather than loading whole contigs, the
+ * reference under each read is fetched in fixed size blocks.  Each thread
+ * keeps a small direct mapped cache of recently used blocks.
+ */
+#define REFBLK_SHIFT 16
+#define REFBLK_LEN (1<<REFBLK_SHIFT)
+#define REFBLK_NSLOTS 64
+
+typedef struct {
+	int tid; // -1 if the slot is empty
+	int64_t idx; // block number within the contig
+	int len; // the last block of a contig may be short
+	uint8_t seq[REFBLK_LEN]; // nt16 encoded
+} refblk_t;
+
+/*
+ * Reference sequence state.  Each thread that scans reads needs its own,
+ * as the faidx_t file handle can't be shared between threads.
+ */
+typedef struct {
+	faidx_t *fai; // NULL when using MD tags, or the mapped reference
+	const refarena_idx_t *arena; // preloaded small contigs (shared)
+	refcache_t *cache; // shared decoded contigs
+	refent_t *ent; // contig `tid', pinned in the cache
+	const uint8_t *seq; // nt16 encoded sequence for contig `tid'
+	int tid;
+	int len;
+	refblk_t *blk; // block cache for -R, or NULL
+
+	// mapped reference (shared), and the reference under the current read
+	const refmap_t *map;
+	const refmap_ctg_t *ctg; // contig `tid'
+	uint8_t *span;
+	size_t m_span;
+	int window; // only the reference under the windows is needed
+
+	// reference under the current read, reconstructed from the MD tag
+	uint8_t *md_seq;
+	size_t md_len;
+} refseq_t;
+
+static int
+refseq_init(refseq_t *rs, const opt_t *opt)
+{
+	rs->arena = opt->refarena_idx;
+	rs->cache = opt->refcache;
+	rs->ent = NULL;
+	rs->seq = NULL;
+	rs->tid = -1;
+	rs->len = -1;
+	rs->md_seq = NULL;
+	rs->md_len = 0;
+	rs->fai = NULL;
+	rs->map = opt->refmap;
+	rs->ctg = NULL;
+	rs->span = NULL;
+	rs->m_span = 0;
+	rs->window = opt->window;
+	rs->blk = NULL;
+	if (opt->use_md || rs->map)
+		return 0;
+	rs->fai = fai_load(opt->fasta_fn);
+	if (rs->fai == NULL)
+		return -1;
+	if (opt->sparse) {
+		int i;
+		rs->blk = malloc(REFBLK_NSLOTS * sizeof(*rs->blk));
+		if (rs->blk == NULL) {
+			fprintf(stderr, "refseq_init: failed to allocate memory\n");
+			fai_destroy(rs->fai);
+			rs->fai = NULL;
+			return -1;
+		}
+		for (i=0; i<REFBLK_NSLOTS; i++)
+			rs->blk[i].tid = -1;
+	}
+	return 0;
+}
+
+static void
+refseq_destroy(refseq_t *rs)
+{
+	if (rs->ent)
+		refcache_put(rs->cache, rs->ent);
+	if (rs->md_seq)
+		free(rs->md_seq);
+	if (rs->span)
+		free(rs->span);
+	if (rs->blk)
+		free(rs->blk);
+	if (rs->fai)
+		fai_destroy(rs->fai);
+}
+
+/*
+ * Load reference sequence, if required.  The sequence is nt16 encoded,
+ * one base per byte, so it can be compared directly against the read.
+ */
+static int
+get_refseq(refseq_t *rs, bam_hdr_t *bam_hdr, int tid)
+{
+	if (rs->tid != tid) {
+		int sorted = tid == rs->tid+1;
+
+		if (rs->ent)
+			refcache_put(rs->cache, rs->ent);
+		rs->ent = NULL;
+		rs->seq = NULL;
+		rs->tid = -1;
+		rs->ent = refcache_get(rs->cache, rs->fai, bam_hdr->target_name[tid]);
+		if (rs->ent == NULL)
+			return -1;
+		rs->seq = rs->ent->seq;
+		rs->len = rs->ent->len;
+		rs->tid = tid;
+
+		// input that moves on to the following contig looks sorted,
+		// and will want the next contig soon
+		if (sorted && tid+1 < bam_hdr->n_targets)
+			refcache_prefetch(rs->cache, bam_hdr->target_name[tid+1]);
+	}
+
+	return rs->len;
+}
+
+/*
+ * The read's name, for diagnostics.  CRAM input is decoded without
+ * read names unless they're needed for -o, leaving the name empty.
+ */
+static const char *
+read_name(const bam1_t *b)
+{
+	const char *qname = bam_get_qname(b);
+	return *qname ? qname : "(read name not decoded)";
+}
+
+/*
+ * Reconstruct the reference sequence under a read, from the read's
+ * sequence, CIGAR and MD tag.  Reference skips (N) aren't described
+ * by the MD tag, and are filled with Ns.
+ */
+static int
+get_mdseq(refseq_t *rs, bam1_t *b, const uint8_t **ref)
+{
+	bam1_core_t *c = &b->core;
+	uint8_t *seq = bam_get_seq(b);
+	uint32_t *cigar = bam_get_cigar(b);
+	size_t len = bam_endpos(b) - c->pos;
+	uint8_t *aux;
+	char *md;
+	long n; // matches remaining before the next MD mismatch or deletion
+	int i, j, x, y;
+
+	aux = bam_aux_get(b, "MD");
+	md = aux ? bam_aux2Z(aux) : NULL;
+	if (md == NULL) {
+		fprintf(stderr, "%s: no MD tag, which is required for -m\n",
+				read_name(b));
+		return -1;
+	}
+
+	if (rs->md_len < len) {
+		uint8_t *tmp = realloc(rs->md_seq, len);
+		if (tmp == NULL) {
+			perror("realloc:get_mdseq");
+			return -1;
+		}
+		rs->md_seq = tmp;
+		rs->md_len = len;
+	}
+
+	n = strtol(md, &md, 10);
+
+	for (i = x = y = 0; i < c->n_cigar; ++i) {
+		int op = bam_cigar_op(cigar[i]);
+		int l = bam_cigar_oplen(cigar[i]);
+
+		if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
+			for (j = 0; j < l; ++j, ++x, ++y) {
+				if (n > 0) {
+					rs->md_seq[x] = bam_seqi(seq, y);
+					n--;
+				} else if (isalpha(*md)) {
+					rs->md_seq[x] = seq_nt16_table[(uint8_t)*md++];
+					n = strtol(md, &md, 10);
+				} else
+					goto malformed;
+			}
+		} else if (op == BAM_CSOFT_CLIP || op == BAM_CINS) {
+			y += l;
+		} else if (op == BAM_CDEL) {
+			if (n > 0 || *md != '^')
+				goto malformed;
+			md++;
+			for (j = 0; j < l; ++j, ++x) {
+				if (!isalpha(*md))
+					goto malformed;
+				rs->md_seq[x] = seq_nt16_table[(uint8_t)*md++];
+			}
+			n = strtol(md, &md, 10);
+		} else if (op == BAM_CREF_SKIP) {
+			memset(rs->md_seq+x, seq_nt16_table['N'], l);
+			x += l;
+		}
+	}
+
+	*ref = rs->md_seq;
+	return 0;
+malformed:
+	fprintf(stderr, "%s: MD tag doesn't match the CIGAR\n", read_name(b));
+	return -1;
+}
+
+/*
+ * Ensure the span buffer can hold n bases.
+ */
+static int
+span_reserve(refseq_t *rs, size_t n)
+{
+	if (n > rs->m_span) {
+		uint8_t *tmp = realloc(rs->span, n);
+		if (tmp == NULL) {
+			fprintf(stderr, "span_reserve: failed to allocate memory\n");
+			return -1;
+		}
+		rs->span = tmp;
+		rs->m_span = n;
+	}
+	return 0;
+}
+
+/*
+ * Reference offsets [0,*xl) and [*xr,span) that scan_windows() will read,
+ * relative to the read's leftmost aligned position.  These are the bases
+ * under the left and right windows, and the two terminal bases.
+ */
+static void
+window_extent(const bam1_t *b, int window, int64_t *xl, int64_t *xr)
+{
+	const bam1_core_t *c = &b->core;
+	const uint32_t *cigar = bam_get_cigar(b);
+	int64_t span = bam_endpos(b) - c->pos;
+	int64_t x, y, lo;
+	int i;
+
+	*xl = 1;
+	*xr = span - 1;
+
+	// as for the left window walk in scan_windows()
+	for (i = x = y = 0; i < c->n_cigar && y < window; ++i) {
+		int op = bam_cigar_op(cigar[i]);
+		int l = bam_cigar_oplen(cigar[i]);
+
+		if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
+			int64_t n = window - y < l ? window - y : l;
+			if (x + n > *xl)
+				*xl = x + n;
+			x += l;
+			y += l;
+		} else if (op == BAM_CSOFT_CLIP || op == BAM_CINS) {
+			y += l;
+		} else if (op == BAM_CREF_SKIP || op == BAM_CDEL) {
+			x += l;
+		}
+	}
+
+	// and for the right window walk
+	lo = c->l_qseq - window > window ? c->l_qseq - window : window;
+	x = span;
+	y = c->l_qseq;
+	for (i = c->n_cigar-1; i >= 0 && c->l_qseq-y < window && y > window; --i) {
+		int op = bam_cigar_op(cigar[i]);
+		int l = bam_cigar_oplen(cigar[i]);
+
+		if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
+			x -= l;
+			y -= l;
+			int64_t s = y > lo ? y : lo;
+			if (y + l > s && x + (s-y) < *xr)
+				*xr = x + (s-y);
+		} else if (op == BAM_CSOFT_CLIP || op == BAM_CINS) {
+			y -= l;
+		} else if (op == BAM_CREF_SKIP || op == BAM_CDEL) {
+			x -= l;
+		}
+	}
+
+	if (*xl > *xr)
+		*xl = *xr = span;
+}
+
+/*
+ * Get the reference under a read from the mapped fasta.  Only the bases
+ * under the terminal windows are converted, into the span buffer at their
+ * offsets from the read's leftmost aligned position, so the cost doesn't
+ * grow with the length of the read.  The rest of the buffer isn't read.
+ */
+static int
+get_mapspan(refseq_t *rs, bam_hdr_t *bam_hdr, bam1_t *b, const uint8_t **ref)
+{
+	int tid = b->core.tid;
+	int64_t xl, xr;
+
+	if (rs->tid != tid) {
+		int sorted = tid == rs->tid+1;
+
+		rs->ctg = refmap_find(rs->map, bam_hdr->target_name[tid]);
+		if (rs->ctg == NULL) {
+			fprintf(stderr, "bam has region `%s', which is not in fasta file\n",
+					bam_hdr->target_name[tid]);
+			return -1;
+		}
+		rs->tid = tid;
+
+		// as in get_refseq(), only prefetch for input that looks sorted
+		if (sorted && tid+1 < bam_hdr->n_targets) {
+			const refmap_ctg_t *next = refmap_find(rs->map, bam_hdr->target_name[tid+1]);
+			if (next)
+				refmap_willneed(rs->map, next);
+		}
+	}
+
+	int64_t beg = b->core.pos;
+	int64_t end = bam_endpos(b);
+	if (end > rs->ctg->len) {
+		fprintf(stderr, "%s: read mapped outside the reference sequence: bam/ref mismatch?\n",
+				read_name(b));
+		return 1;
+	}
+
+	if (span_reserve(rs, end - beg) < 0)
+		return -1;
+
+	window_extent(b, rs->window, &xl, &xr);
+	if (refmap_fetch(rs->map, rs->ctg, beg, beg + xl, rs->span) < 0
+			|| refmap_fetch(rs->map, rs->ctg, beg + xr, end, rs->span + xr) < 0) {
+		fprintf(stderr, "`%s' is truncated, or doesn't match its .fai\n",
+				bam_hdr->target_name[tid]);
+		return -1;
+	}
+
+	*ref = rs->span;
+	return 0;
+}
+
+/*
+ * Get block idx of contig tid, from the block cache or from the fasta.
+ */
+static const refblk_t *
+get_refblk(refseq_t *rs, bam_hdr_t *bam_hdr, int tid, int64_t idx)
+{
+	refblk_t *k = &rs->blk[(uint64_t)(idx + (int64_t)tid*REFBLK_NSLOTS/2) % REFBLK_NSLOTS];
+	int64_t beg, end;
+	char *s;
+	int i, len;
+
+	if (k->tid == tid && k->idx == idx)
+		return k;
+
+	beg = idx << REFBLK_SHIFT;
+	end = beg + REFBLK_LEN;
+	if (end > rs->len)
+		end = rs->len;
+	k->tid = -1;
+	s = faidx_fetch_seq(rs->fai, bam_hdr->target_name[tid], beg, end-1, &len);
+	if (s == NULL || len != end - beg) {
+		fprintf(stderr, "`%s': failed to fetch %"PRId64"-%"PRId64" from the fasta file\n",
+				bam_hdr->target_name[tid], beg+1, end);
+		free(s);
+		return NULL;
+	}
+	for (i=0; i<len; i++)
+		k->seq[i] = seq_nt16_table[(uint8_t)s[i]];
+	free(s);
+	k->tid = tid;
+	k->idx = idx;
+	k->len = len;
+
+	return k;
+}
+
+/*
+ * Get the reference under a read from the block cache.  Reads within
+ * a single block are used in place, others are copied to the span buffer.
+ */
+static int
+get_blkspan(refseq_t *rs, bam_hdr_t *bam_hdr, bam1_t *b, const uint8_t **ref)
+{
+	const refblk_t *k;
+	int tid = b->core.tid;
+
+	if (rs->tid != tid) {
+		rs->len = faidx_seq_len(rs->fai, bam_hdr->target_name[tid]);
+		if (rs->len == -1) {
+			fprintf(stderr, "bam has region `%s', which is not in fasta file\n",
+					bam_hdr->target_name[tid]);
+			return -1;
+		}
+		rs->tid = tid;
+	}
+
+	int64_t beg = b->core.pos;
+	int64_t end = bam_endpos(b);
+	if (end > rs->len) {
+		fprintf(stderr, "%s: read mapped outside the reference sequence: bam/ref mismatch?\n",
+				read_name(b));
+		return 1;
+	}
+
+	if (end > beg && beg >> REFBLK_SHIFT == (end-1) >> REFBLK_SHIFT) {
+		k = get_refblk(rs, bam_hdr, tid, beg >> REFBLK_SHIFT);
+		if (k == NULL)
+			return -1;
+		*ref = k->seq + (beg & (REFBLK_LEN-1));
+		return 0;
+	}
+
+	if (span_reserve(rs, end - beg) < 0)
+		return -1;
+
+	int64_t x = beg;
+	while (x < end) {
+		int64_t off = x & (REFBLK_LEN-1);
+		int64_t n = REFBLK_LEN - off;
+		if (n > end - x)
+			n = end - x;
+		k = get_refblk(rs, bam_hdr, tid, x >> REFBLK_SHIFT);
+		if (k == NULL)
+			return -1;
+		memcpy(rs->span + (x - beg), k->seq + off, n);
+		x += n;
+	}
+
+	*ref = rs->span;
+	return 0;
+}
+
+/*
+ * Get the reference sequence under a read.  On success, *ref points
+ * to the reference base at the read's leftmost aligned position.
+ * Returns 0 on success, 1 if the read should be skipped, or -1 on error.
+ */
+static int
+get_refspan(refseq_t *rs, bam_hdr_t *bam_hdr, bam1_t *b, const uint8_t **ref)
+{
+	const refarena_idx_t *a = rs->arena;
+	int tid = b->core.tid;
+
+	if (a && a->off[tid] >= 0) {
+		if (bam_endpos(b) > a->len[tid]) {
+			fprintf(stderr, "%s: read mapped outside the reference sequence: bam/ref mismatch?\n",
+					read_name(b));
+			return 1;
+		}
+		*ref = a->seq + a->off[tid] + b->core.pos;
+		return 0;
+	}
+
+	if (rs->map)
+		return get_mapspan(rs, bam_hdr, b, ref);
+
+	if (rs->fai == NULL)
+		return get_mdseq(rs, b, ref);
+
+	if (rs->blk)
+		return get_blkspan(rs, bam_hdr, b, ref);
+
+	int ref_len = get_refseq(rs, bam_hdr, tid);
+	if (ref_len == -1)
+		return -1;
+
+	if (bam_endpos(b) > ref_len) {
+		fprintf(stderr, "%s: read mapped outside the reference sequence: bam/ref mismatch?\n",
+				read_name(b));
+		return 1;
+	}
+
+	*ref = rs->seq + b->core.pos;
+	return 0;
+}
+
+/*
+ * Address of reference base x of contig tid, if it's already at hand,
+ * or NULL.  This has no side effects, so it's used for prefetching the
+ * reference under reads that are about to be scanned.
+ */
+static const void *
+refbase_addr(const refseq_t *rs, int tid, int64_t x)
+{
+	const refarena_idx_t *a = rs->arena;
+
+	if (a && a->off[tid] >= 0)
+		return x < a->len[tid] ? a->seq + a->off[tid] + x : NULL;
+
+	if (tid != rs->tid)
+		return NULL;
+
+	if (rs->map) {
+		const refmap_ctg_t *ctg = rs->ctg;
+		if (x >= ctg->len)
+			return NULL;
+		if (rs->map->packed)
+			return rs->map->base + ctg->offset + (x>>2);
+		return rs->map->base + ctg->offset + x / ctg->line_blen * ctg->line_len
+			+ x % ctg->line_blen;
+	}
+
+	if (rs->blk) {
+		int64_t idx = x >> REFBLK_SHIFT;
+		const refblk_t *k = &rs->blk[(uint64_t)(idx + (int64_t)tid*REFBLK_NSLOTS/2) % REFBLK_NSLOTS];
+		return k->tid == tid && k->idx == idx ? k->seq + (x & (REFBLK_LEN-1)) : NULL;
+	}
+
+	return rs->seq && x < rs->len ? rs->seq + x : NULL;
+}
+
+/*
+ * Prefetch the reference under both ends of an upcoming read.
+ */
+static inline void
+refspan_prefetch(const refseq_t *rs, const bam1_core_t *c)
+{
+	const void *p;
+
+	if (c->tid < 0 || c->pos < 0)
+		return;
+	if ((p = refbase_addr(rs, c->tid, c->pos)) != NULL)
+		__builtin_prefetch(p);
+	if ((p = refbase_addr(rs, c->tid, c->pos + (c->l_qseq ? c->l_qseq-1 : 0))) != NULL)
+		__builtin_prefetch(p);
+}
+
+enum {_5C2T=0, _3C2T, _5G2A, _3G2A};
+#define COND_5C2T (1<<_5C2T)
+#define COND_3C2T (1<<_3C2T)
+#define COND_5G2A (1<<_5G2A)
+#define COND_3G2A (1<<_3G2A)
+
+// One bucket for each combination of the four conditions above.
+#define NBUCKETS (1<<4)
+
+struct counts {
+	uint64_t c, c2t, g, g2a;
+};
+
+/*
+ * Damage patterns and fragment length histograms.  Each read is counted
+ * in the bucket for its `cond' mask, so that a base needs only a single
+ * increment.  The unconditional and conditional totals are obtained by
+ * summing over the buckets, in damage_print().
+ */
+typedef struct {
+	struct counts *counts5, // counts for the window towards the 5' end
+		      *counts3; // counts for the window towards the 3' end
+	uint64_t *lhist; // fragment length counts
+} damage_t;
+
+// index for position z (or length z) and condition mask cond
+#define BUCKET(z, cond) ((z)*NBUCKETS + (cond))
+
+static int
+damage_init(damage_t *dmg, const opt_t *opt)
+{
+	dmg->counts5 = calloc(opt->window*NBUCKETS, sizeof(*dmg->counts5));
+	if (dmg->counts5 == NULL) {
+		perror("calloc:counts5");
+		goto err0;
+	}
+
+	dmg->counts3 = calloc(opt->window*NBUCKETS, sizeof(*dmg->counts3));
+	if (dmg->counts3 == NULL) {
+		perror("calloc:counts3");
+		goto err1;
+	}
+
+	dmg->lhist = calloc(opt->lmax*NBUCKETS, sizeof(*dmg->lhist));
+	if (dmg->lhist == NULL) {
+		perror("calloc:lhist");
+		goto err2;
+	}
+
+	return 0;
+err2:
+	free(dmg->counts3);
+err1:
+	free(dmg->counts5);
+err0:
+	return -1;
+}
+
+static void
+damage_free(damage_t *dmg)
+{
+	free(dmg->lhist);
+	free(dmg->counts3);
+	free(dmg->counts5);
+}
+
+/*
+ * Add the counts from src into dst.
+ */
+static void
+damage_add(damage_t *dst, const damage_t *src, const opt_t *opt)
+{
+	int i;
+
+	for (i=0; i<opt->window*NBUCKETS; i++) {
+		dst->counts5[i].c += src->counts5[i].c;
+		dst->counts5[i].c2t += src->counts5[i].c2t;
+		dst->counts5[i].g += src->counts5[i].g;
+		dst->counts5[i].g2a += src->counts5[i].g2a;
+		dst->counts3[i].c += src->counts3[i].c;
+		dst->counts3[i].c2t += src->counts3[i].c2t;
+		dst->counts3[i].g += src->counts3[i].g;
+		dst->counts3[i].g2a += src->counts3[i].g2a;
+	}
+
+	for (i=0; i<opt->lmax*NBUCKETS; i++)
+		dst->lhist[i] += src->lhist[i];
+}
+
+/*
+ * Window kernels.  These classify a run of up to 64 consecutive aligned
+ * bases, starting at query offset y of the packed read sequence seq,
+ * against the nt16 reference ref.  Bit j of each mask is set for the
+ * base at y+j, with masks m[0]=C, m[1]=G, m[2]=C2T, m[3]=G2A, in the
+ * same order as the BASE_* classes.
+ */
+#define RUN_MAX 64
+
+typedef void (*classify_fn)(const uint8_t *seq, int y, const uint8_t *ref,
+		int n, uint64_t m[4]);
+
+static inline uint64_t
+run_mask(int n)
+{
+	return n >= RUN_MAX ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1;
+}
+
+static void
+classify_scalar(const uint8_t *seq, int y, const uint8_t *ref, int n, uint64_t m[4])
+{
+	int j;
+
+	m[0] = m[1] = m[2] = m[3] = 0;
+	for (j=0; j<n; j++) {
+		uint64_t cls = NT16_CLASS(ref[j], bam_seqi(seq, y+j));
+		m[0] |= (cls & 1) << j;
+		m[1] |= (cls>>1 & 1) << j;
+		m[2] |= (cls>>2 & 1) << j;
+		m[3] |= (cls>>3 & 1) << j;
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_SIMD_KERNELS
+
+/*
+ * The kernels load whole vectors, which may extend past the end of the
+ * run, and so past the end of the read or reference.  The bits for bases
+ * past n are masked off, so this is harmless as long as the load can't
+ * fault.  Loads are made in place when they stay within a page, and only
+ * a run near the end of a page is first copied to a buffer.  The packed
+ * read bases are loaded from the byte containing base y, and if y is odd,
+ * the kernels realign the nibbles after loading.  The AVX-512 kernel uses
+ * masked loads, which don't fault, instead.
+ */
+#define PBUF_LEN 48 // packed read bytes that may be loaded
+#define RBUF_LEN 64 // reference bytes that may be loaded
+
+// the loads beyond the run are deliberate
+#define NO_SANITIZE __attribute__((no_sanitize_address, no_sanitize_thread))
+
+static inline __attribute__((always_inline)) const uint8_t *
+run_src(const uint8_t *p, int len, int n, uint8_t *buf)
+{
+	if (((uintptr_t)p & 4095) <= 4096 - len)
+		return p;
+	memcpy(buf, p, n);
+	return buf;
+}
+
+__attribute__((target("sse4.2"))) NO_SANITIZE
+static void
+classify_sse42(const uint8_t *seq, int y, const uint8_t *ref, int n, uint64_t m[4])
+{
+	uint8_t pbuf[PBUF_LEN], rbuf[RBUF_LEN];
+	const __m128i lo4 = _mm_set1_epi8(0x0f), hi4 = _mm_set1_epi8(0xf0);
+	const __m128i nt_a = _mm_set1_epi8(1), nt_c = _mm_set1_epi8(2);
+	const __m128i nt_g = _mm_set1_epi8(4), nt_t = _mm_set1_epi8(8);
+	const uint8_t *ps = run_src(seq + (y>>1), PBUF_LEN, ((y+n+1)>>1) - (y>>1), pbuf);
+	const uint8_t *rs = run_src(ref, RBUF_LEN, n, rbuf);
+	int j;
+
+	m[0] = m[1] = m[2] = m[3] = 0;
+
+	for (j=0; j<n; j+=16) {
+		__m128i p = _mm_loadl_epi64((const __m128i *)(ps + j/2));
+		if (y & 1) {
+			__m128i p1 = _mm_loadl_epi64((const __m128i *)(ps + j/2 + 1));
+			p = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(p, 4), hi4),
+					_mm_and_si128(_mm_srli_epi16(p1, 4), lo4));
+		}
+		// unpack nibbles, 0x00ab -> 0x0b0a, giving bases a,b in byte order
+		__m128i w = _mm_cvtepu8_epi16(p);
+		__m128i q = _mm_or_si128(_mm_srli_epi16(w, 4),
+				_mm_slli_epi16(_mm_and_si128(w, lo4), 8));
+		__m128i r = _mm_loadu_si128((const __m128i *)(rs + j));
+
+		__m128i rc = _mm_cmpeq_epi8(r, nt_c);
+		__m128i rg = _mm_cmpeq_epi8(r, nt_g);
+		__m128i c2t = _mm_and_si128(rc, _mm_cmpeq_epi8(q, nt_t));
+		__m128i g2a = _mm_and_si128(rg, _mm_cmpeq_epi8(q, nt_a));
+
+		m[0] |= (uint64_t)(uint16_t)_mm_movemask_epi8(rc) << j;
+		m[1] |= (uint64_t)(uint16_t)_mm_movemask_epi8(rg) << j;
+		m[2] |= (uint64_t)(uint16_t)_mm_movemask_epi8(c2t) << j;
+		m[3] |= (uint64_t)(uint16_t)_mm_movemask_epi8(g2a) << j;
+	}
+
+	m[0] &= run_mask(n);
+	m[1] &= run_mask(n);
+	m[2] &= run_mask(n);
+	m[3] &= run_mask(n);
+}
+
+__attribute__((target("avx2"))) NO_SANITIZE
+static void
+classify_avx2(const uint8_t *seq, int y, const uint8_t *ref, int n, uint64_t m[4])
+{
+	uint8_t pbuf[PBUF_LEN], rbuf[RBUF_LEN];
+	const __m128i lo4 = _mm_set1_epi8(0x0f), hi4 = _mm_set1_epi8(0xf0);
+	const __m256i lo4w = _mm256_set1_epi16(0x0f);
+	const __m256i nt_a = _mm256_set1_epi8(1), nt_c = _mm256_set1_epi8(2);
+	const __m256i nt_g = _mm256_set1_epi8(4), nt_t = _mm256_set1_epi8(8);
+	const uint8_t *ps = run_src(seq + (y>>1), PBUF_LEN, ((y+n+1)>>1) - (y>>1), pbuf);
+	const uint8_t *rs = run_src(ref, RBUF_LEN, n, rbuf);
+	int j;
+
+	m[0] = m[1] = m[2] = m[3] = 0;
+
+	for (j=0; j<n; j+=32) {
+		__m128i p = _mm_loadu_si128((const __m128i *)(ps + j/2));
+		if (y & 1) {
+			__m128i p1 = _mm_loadu_si128((const __m128i *)(ps + j/2 + 1));
+			p = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(p, 4), hi4),
+					_mm_and_si128(_mm_srli_epi16(p1, 4), lo4));
+		}
+		__m256i w = _mm256_cvtepu8_epi16(p);
+		__m256i q = _mm256_or_si256(_mm256_srli_epi16(w, 4),
+				_mm256_slli_epi16(_mm256_and_si256(w, lo4w), 8));
+		__m256i r = _mm256_loadu_si256((const __m256i *)(rs + j));
+
+		__m256i rc = _mm256_cmpeq_epi8(r, nt_c);
+		__m256i rg = _mm256_cmpeq_epi8(r, nt_g);
+		__m256i c2t = _mm256_and_si256(rc, _mm256_cmpeq_epi8(q, nt_t));
+		__m256i g2a = _mm256_and_si256(rg, _mm256_cmpeq_epi8(q, nt_a));
+
+		m[0] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(rc) << j;
+		m[1] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(rg) << j;
+		m[2] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(c2t) << j;
+		m[3] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(g2a) << j;
+	}
+
+	m[0] &= run_mask(n);
+	m[1] &= run_mask(n);
+	m[2] &= run_mask(n);
+	m[3] &= run_mask(n);
+}
+
+__attribute__((target("avx512bw,avx512vl")))
+static void
+classify_avx512(const uint8_t *seq, int y, const uint8_t *ref, int n, uint64_t m[4])
+{
+	const __m256i lo4 = _mm256_set1_epi8(0x0f), hi4 = _mm256_set1_epi8(0xf0);
+	const __m512i lo4w = _mm512_set1_epi16(0x0f);
+	const __m512i nt_a = _mm512_set1_epi8(1), nt_c = _mm512_set1_epi8(2);
+	const __m512i nt_g = _mm512_set1_epi8(4), nt_t = _mm512_set1_epi8(8);
+	const uint8_t *ps = seq + (y>>1);
+	int l_ps = ((y+n+1)>>1) - (y>>1); // packed bytes in the run
+
+	__m256i p = _mm256_maskz_loadu_epi8((uint32_t)run_mask(l_ps), ps);
+	if (y & 1) {
+		__m256i p1 = _mm256_maskz_loadu_epi8((uint32_t)run_mask(l_ps-1), ps + 1);
+		p = _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(p, 4), hi4),
+				_mm256_and_si256(_mm256_srli_epi16(p1, 4), lo4));
+	}
+	__m512i w = _mm512_cvtepu8_epi16(p);
+	__m512i q = _mm512_or_si512(_mm512_srli_epi16(w, 4),
+			_mm512_slli_epi16(_mm512_and_si512(w, lo4w), 8));
+	__m512i r = _mm512_maskz_loadu_epi8(run_mask(n), ref);
+
+	__mmask64 rc = _mm512_cmpeq_epi8_mask(r, nt_c);
+	__mmask64 rg = _mm512_cmpeq_epi8_mask(r, nt_g);
+	__mmask64 qt = _mm512_cmpeq_epi8_mask(q, nt_t);
+	__mmask64 qa = _mm512_cmpeq_epi8_mask(q, nt_a);
+
+	m[0] = rc & run_mask(n);
+	m[1] = rg & run_mask(n);
+	m[2] = rc & qt & run_mask(n);
+	m[3] = rg & qa & run_mask(n);
+}
+#endif
+
+static classify_fn classify = classify_scalar;
+
+/*
+ * Choose the best window kernel for this cpu.
+ */
+static void
+classify_init(void)
+{
+#ifdef HAVE_SIMD_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl"))
+		classify = classify_avx512;
+	else if (__builtin_cpu_supports("avx2"))
+		classify = classify_avx2;
+	else if (__builtin_cpu_supports("sse4.2"))
+		classify = classify_sse42;
+#endif
+}
+
+/*
+ * Bits j of a run starting at query offset y, for which the base is
+ * within t1 bases of the start of the read, or t2 bases of the end.
+ */
+static inline uint64_t
+near_ends(int y, int l_qseq, int t1, int t2)
+{
+	uint64_t mask = 0;
+	int a = t1 - y; // j < a
+	int b = l_qseq - t2 - y; // j >= b
+
+	if (a > 0)
+		mask |= run_mask(a);
+	if (b < RUN_MAX)
+		mask |= b <= 0 ? ~(uint64_t)0 : ~run_mask(b);
+	return mask;
+}
+
+/*
+ * Record the (mis)matches for a run of consecutive aligned bases, which
+ * lie within the window at the left end of the read, or within the
+ * window at the right end of the read.  The strand and end are compile
+ * time constants in each instance of scan_windows() below, so the
+ * strand swaps here are resolved by the compiler.
+ */
+static inline __attribute__((always_inline)) void
+scan_run(const opt_t *opt, damage_t *dmg, int cond, const int rev, const int right,
+		const uint8_t *seq, int y, const uint8_t *ref, int n, int l_qseq,
+		int *b_out)
+{
+	// 5' and 3' are swapped for reverse reads, and for the right window
+	struct counts *cnt = (right ^ rev) ? dmg->counts3 : dmg->counts5;
+
+	// thresholds for writing out the read, from the start/end of the read
+	const int c2t_t1 = rev ? opt->c3 : opt->c5;
+	const int c2t_t2 = rev ? opt->c5 : opt->c3;
+	const int g2a_t1 = rev ? opt->g3 : opt->g5;
+	const int g2a_t2 = rev ? opt->g5 : opt->g3;
+
+	while (n > 0) {
+		int len = n < RUN_MAX ? n : RUN_MAX;
+		uint64_t m[4];
+
+		classify(seq, y, ref, len, m);
+
+		// ref C and G swap for reverse reads, as do C->T and G->A
+		uint64_t m_c = rev ? m[1] : m[0];
+		uint64_t m_g = rev ? m[0] : m[1];
+		uint64_t m_c2t = rev ? m[3] : m[2];
+		uint64_t m_g2a = rev ? m[2] : m[3];
+
+// update counts for each set bit in the mask
+#define c_update(mask, var) \
+	do { \
+		uint64_t _w = (mask); \
+		while (_w) { \
+			int z1 = y + __builtin_ctzll(_w); \
+			cnt[BUCKET(right ? l_qseq-1-z1 : z1, cond)].var++; \
+			_w &= _w - 1; \
+		} \
+	} while (0)
+
+		c_update(m_c, c);
+		c_update(m_c2t, c2t);
+		c_update(m_g, g);
+		c_update(m_g2a, g2a);
+#undef c_update
+
+		if (m_c2t & near_ends(y, l_qseq, c2t_t1, c2t_t2))
+			*b_out = 1;
+		if (m_g2a & near_ends(y, l_qseq, g2a_t1, g2a_t2))
+			*b_out = 1;
+
+		y += len;
+		ref += len;
+		n -= len;
+	}
+}
+
+/*
+ * Record the (mis)matches in the terminal windows of an aligned read,
+ * and set *cond from the mismatches at either end.
+ * Returns 1 if the read should be written to the output bam, 0 otherwise.
+ */
+static inline __attribute__((always_inline)) int
+scan_windows(const opt_t *opt, damage_t *dmg, const bam1_t *b,
+		const uint8_t *ref, const int rev, int *condp)
+{
+	const bam1_core_t *c = &b->core;
+	int i, op;
+	int x, // offset in ref, from the leftmost aligned position
+	    y; // offset in query seq
+	uint8_t cls;
+
+	int b_out = 0;
+	int cond = 0;
+
+	const uint8_t *seq = bam_get_seq(b);
+	const uint32_t *cigar = bam_get_cigar(b);
+
+	// check for mismatch at left most position
+	op = bam_cigar_op(cigar[0]);
+	if (op==BAM_CMATCH || op==BAM_CEQUAL || op==BAM_CDIFF) {
+		cls = NT16_CLASS(ref[0], bam_seqi(seq, 0));
+
+		if (cls & BASE_C2T)
+			cond |= rev ? COND_3G2A : COND_5C2T;
+		if (cls & BASE_G2A)
+			cond |= rev ? COND_3C2T : COND_5G2A;
+	}
+
+	// check for mismatch at right most position
+	op = bam_cigar_op(cigar[c->n_cigar-1]);
+	if (op==BAM_CMATCH || op==BAM_CEQUAL || op==BAM_CDIFF) {
+		cls = NT16_CLASS(ref[bam_endpos(b)-c->pos-1], bam_seqi(seq, c->l_qseq-1));
+
+		if (cls & BASE_G2A)
+			cond |= rev ? COND_5C2T : COND_3G2A;
+		if (cls & BASE_C2T)
+			cond |= rev ? COND_5G2A : COND_3C2T;
+	}
+
+	// walk inwards from the left end, until we leave the window
+	for (i = x = y = 0; i < c->n_cigar && y < opt->window; ++i) {
+		int op = bam_cigar_op(cigar[i]);
+		int l = bam_cigar_oplen(cigar[i]);
+
+		if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
+			int n = opt->window - y;
+			if (l < n)
+				n = l;
+			scan_run(opt, dmg, cond, rev, 0, seq, y, ref+x, n,
+					c->l_qseq, &b_out);
+			x += l;
+			y += l;
+		} else if (op == BAM_CSOFT_CLIP || op == BAM_CINS) {
+			y += l;
+		} else if (op == BAM_CREF_SKIP || op == BAM_CDEL) {
+			x += l;
+		}
+	}
+
+	// walk inwards from the right end, until we leave the window,
+	// or reach the part of the read that was already scanned
+	int lo = opt->window; // leftmost query offset in the right window
+	if (c->l_qseq - lo > lo)
+		lo = c->l_qseq - lo;
+	x = bam_endpos(b) - c->pos;
+	y = c->l_qseq;
+	for (i = c->n_cigar-1; i >= 0 && c->l_qseq-y < opt->window && y > opt->window; --i) {
+		int op = bam_cigar_op(cigar[i]);
+		int l = bam_cigar_oplen(cigar[i]);
+
+		if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
+			x -= l;
+			y -= l;
+			// clip to the window, and to the part not yet scanned
+			int s = y > lo ? y : lo;
+			if (y + l > s)
+				scan_run(opt, dmg, cond, rev, 1, seq, s, ref+x+(s-y),
+						y+l-s, c->l_qseq, &b_out);
+		} else if (op == BAM_CSOFT_CLIP || op == BAM_CINS) {
+			y -= l;
+		} else if (op == BAM_CREF_SKIP || op == BAM_CDEL) {
+			x -= l;
+		}
+	}
+
+	*condp = cond;
+	return b_out;
+}
+
+/*
+ * Forward and reverse strand instances of scan_windows().
+ */
+#define SCAN_WINDOWS(name, rev) \
+static int \
+name(const opt_t *opt, damage_t *dmg, const bam1_t *b, \
+		const uint8_t *ref, int *condp) \
+{ \
+	return scan_windows(opt, dmg, b, ref, rev, condp); \
+}
+SCAN_WINDOWS(scan_windows_fwd, 0)
+SCAN_WINDOWS(scan_windows_rev, 1)
+#undef SCAN_WINDOWS
+
+/*
+ * Record the (mis)matches in the terminal windows of a read.
+ * Returns 1 if the read should be written to the output bam,
+ * 0 if it should not, or -1 on error.
+ */
+static int
+scan_read(const opt_t *opt, damage_t *dmg, refseq_t *rs, bam_hdr_t *bam_hdr, bam1_t *b)
+{
+	int i;
+	bam1_core_t *c = &b->core;
+
+	if (c->flag & (BAM_FUNMAP|BAM_FQCFAIL|BAM_FDUP|
+			BAM_FSECONDARY|BAM_FSUPPLEMENTARY))
+		// skip these
+		return 0;
+
+	if (c->flag & BAM_FPAIRED)
+		return 0;
+
+	if (opt->fwd_only && bam_is_rev(b))
+		return 0;
+
+	if (opt->rev_only && !bam_is_rev(b))
+		return 0;
+
+	int qlen = 0;
+	int b_out;
+	int cond;
+	uint32_t *cigar = bam_get_cigar(b);
+	const uint8_t *ref; // nt16 reference, from the leftmost aligned position
+	int r = get_refspan(rs, bam_hdr, b, &ref);
+
+	if (r != 0)
+		return r < 0 ? -1 : 0;
+
+	if (bam_is_rev(b))
+		b_out = scan_windows_rev(opt, dmg, b, ref, &cond);
+	else
+		b_out = scan_windows_fwd(opt, dmg, b, ref, &cond);
+
+	// fragment length
+	for (i = 0; i < c->n_cigar; ++i) {
+		int op = bam_cigar_op(cigar[i]);
+		if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF
+				|| op == BAM_CSOFT_CLIP || op == BAM_CINS
+				|| op == BAM_CHARD_CLIP)
+			qlen += bam_cigar_oplen(cigar[i]);
+	}
+
+	if (qlen < opt->lmax)
+		dmg->lhist[BUCKET(qlen, cond)]++;
+
+	return b_out;
+}
+
+/*
+ * Prefetch distance, in reads, for scan_batch().
+ */
+#define PREFETCH_AHEAD 8
+
+/*
+ * Scan a batch of n reads, setting out[i] if read i should be written to
+ * the output bam.  The record data, and the reference under each read,
+ * are prefetched a few reads ahead.  Returns 0 on success, -1 on error.
+ */
+static int
+scan_batch(const opt_t *opt, damage_t *dmg, refseq_t *rs, bam_hdr_t *bam_hdr,
+		bam1_t **b, char *out, int n)
+{
+	int i;
+
+	for (i=0; i<PREFETCH_AHEAD && i<n; i++)
+		__builtin_prefetch(b[i]->data);
+
+	for (i=0; i<n; i++) {
+		if (i + PREFETCH_AHEAD < n) {
+			const bam1_t *nb = b[i + PREFETCH_AHEAD];
+			__builtin_prefetch(nb->data);
+
+			// reads in sorted input are usually on the contig already loaded
+			refspan_prefetch(rs, &b[i + PREFETCH_AHEAD/2]->core);
+		}
+
+		int b_out = scan_read(opt, dmg, rs, bam_hdr, b[i]);
+		if (b_out < 0)
+			return -1;
+		out[i] = b_out;
+	}
+
+	return 0;
+}
+
+/*
+ * Unconditional and conditional totals for one position of a window.
+ */
+struct totals {
+	uint64_t c, c2t, g, g2a;
+	struct counts cond[4];
+};
+
+/*
+ * Sum the buckets for window position z.
+ */
+static void
+sum_counts(struct totals *t, const struct counts *cnt, int z)
+{
+	int k, m;
+
+	memset(t, 0, sizeof(*t));
+	for (m=0; m<NBUCKETS; m++) {
+		const struct counts *bkt = &cnt[BUCKET(z, m)];
+		t->c += bkt->c;
+		t->c2t += bkt->c2t;
+		t->g += bkt->g;
+		t->g2a += bkt->g2a;
+		for (k=0; k<4; k++) {
+			if (m & (1<<k)) {
+				t->cond[k].c += bkt->c;
+				t->cond[k].c2t += bkt->c2t;
+				t->cond[k].g += bkt->g;
+				t->cond[k].g2a += bkt->g2a;
+			}
+		}
+	}
+}
+
+static int
+damage_print(const opt_t *opt, const damage_t *dmg, FILE *fp)
+{
+	int i, k, m;
+	struct totals *counts5, *counts3;
+	uint64_t *lhist, *lhist_cond;
+
+	counts5 = malloc(opt->window * sizeof(*counts5));
+	counts3 = malloc(opt->window * sizeof(*counts3));
+	lhist = calloc(opt->lmax, sizeof(*lhist));
+	lhist_cond = calloc(opt->lmax, 4*sizeof(*lhist_cond));
+	if (counts5 == NULL || counts3 == NULL || lhist == NULL || lhist_cond == NULL) {
+		perror("damage_print");
+		free(counts5);
+		free(counts3);
+		free(lhist);
+		free(lhist_cond);
+		return -1;
+	}
+
+	for (i=0; i<opt->window; i++) {
+		sum_counts(&counts5[i], dmg->counts5, i);
+		sum_counts(&counts3[i], dmg->counts3, i);
+	}
+
+	for (i=0; i<opt->lmax; i++) {
+		for (m=0; m<NBUCKETS; m++) {
+			uint64_t n = dmg->lhist[BUCKET(i, m)];
+			lhist[i] += n;
+			for (k=0; k<4; k++) {
+				if (m & (1<<k))
+					lhist_cond[i<<2 | k] += n;
+			}
+		}
+	}
+
+	fprintf(fp, "#condamage version %s\n", CONDAMAGE_VERSION);
+	fprintf(fp, "#cmdline:");
+	for (i=0; i<opt->argc; i++)
+		fprintf(fp, " %s", opt->argv[i]);
+	fprintf(fp, "\n\n");
+
+	// unconditional stats
+	fprintf(fp, "#C2T5\ti\tmm\tn\n");
+	fprintf(fp, "# C2T5  C to T mismatches towards the 5' end\n");
+	fprintf(fp, "# i     distance from 5' end\n");
+	fprintf(fp, "# mm    number of mismatches\n");
+	fprintf(fp, "# n     matches+mismatches (ref has C)\n\n");
+	for (i=0; i<opt->window; i++)
+		fprintf(fp, "C2T5\t%d\t%jd\t%jd\n", i+1, (uintmax_t)counts5[i].c2t, (uintmax_t)counts5[i].c);
+	fprintf(fp, "\n");
+
+	fprintf(fp, "#C2T3\ti\tmm\tn\n");
+	fprintf(fp, "# C2T3  C to T mismatches towards the 3' end\n");
+	fprintf(fp, "# i     distance from 3' end\n");
+	fprintf(fp, "# mm    number of mismatches\n");
+	fprintf(fp, "# n     matches+mismatches (ref has C)\n\n");
+	for (i=0; i<opt->window; i++)
+		fprintf(fp, "C2T3\t%d\t%jd\t%jd\n", i+1, (uintmax_t)counts3[i].c2t, (uintmax_t)counts3[i].c);
+	fprintf(fp, "\n");
+
+	fprintf(fp, "#G2A5\ti\tmm\tn\n");
+	fprintf(fp, "# G2A5  G to A mismatches towards the 5' end\n");
+	fprintf(fp, "# i     distance from 5' end\n");
+	fprintf(fp, "# mm    number of mismatches\n");
+	fprintf(fp, "# n     matches+mismatches (ref has G)\n\n");
+	for (i=0; i<opt->window; i++)
+		fprintf(fp, "G2A5\t%d\t%jd\t%jd\n", i+1, (uintmax_t)counts5[i].g2a, (uintmax_t)counts5[i].g);
+	fprintf(fp, "\n");
+
+	fprintf(fp, "#G2A3\ti\tmm\tn\n");
+	fprintf(fp, "# G2A3  G to A mismatches towards the 3' end\n");
+	fprintf(fp, "# i     distance from 3' end\n");
+	fprintf(fp, "# mm    number of mismatches\n");
+	fprintf(fp, "# n     matches+mismatches (ref has G)\n\n");
+	for (i=0; i<opt->window; i++)
+		fprintf(fp, "G2A3\t%d\t%jd\t%jd\n", i+1, (uintmax_t)counts3[i].g2a, (uintmax_t)counts3[i].g);
+	fprintf(fp, "\n");
+
+
+	// conditional stats
+	int win;
+	for (win=0; win<2; win++) {
+		char ch_win = "53"[win];
+		struct totals *cnts;
+
+		if (win == 0)
+			cnts = counts5;
+		else
+			cnts = counts3;
+
+		for (k=0; k<4; k++) {
+			char *str_cond = ((char *[]){"5C2T", "3C2T", "5G2A", "3G2A"})[k];
+
+			fprintf(fp, "#C2T%c|%s\ti\tmm\tn\n", ch_win, str_cond);
+			fprintf(fp, "# C2T%c|%s  C to T mismatches towards the %c' end,\n", ch_win, str_cond, ch_win);
+			fprintf(fp, "#            conditional on a %c to %c mismatch at the most %c' position\n", str_cond[1], str_cond[3], str_cond[0]);
+			for (i=0; i<opt->window; i++)
+				fprintf(fp, "C2T%c|%s\t%d\t%jd\t%jd\n", ch_win, str_cond, i+1, (uintmax_t)cnts[i].cond[k].c2t, (uintmax_t)cnts[i].cond[k].c);
+			fprintf(fp, "\n");
+
+			fprintf(fp, "#G2A%c|%s\ti\tmm\tn\n", ch_win, str_cond);
+			fprintf(fp, "# G2A%c|%s  G to A mismatches towards the %c' end,\n", ch_win, str_cond, ch_win);
+			fprintf(fp, "#            conditional on a %c to %c mismatch at the most %c' position\n", str_cond[1], str_cond[3], str_cond[0]);
+			for (i=0; i<opt->window; i++)
+				fprintf(fp, "G2A%c|%s\t%d\t%jd\t%jd\n", ch_win, str_cond, i+1, (uintmax_t)cnts[i].cond[k].g2a, (uintmax_t)cnts[i].cond[k].g);
+			fprintf(fp, "\n");
+		}
+	}
+
+	// fragment length histograms
+	int lmax;
 	for (lmax=opt->lmax; lmax>0 && lhist[lmax-1]==0; lmax--)
 		;
 	if (lmax > 0) {
-		printf("#FL\tj\tk\tx1\tx2\tx3\tx4\n");
-		printf("# FL  count of fragments with a given length\n");
-		printf("# j   fragment length\n");
-		printf("# k   number of fragments of length j\n");
-		printf("# x1   number of fragments of length j with a 5' C->T \n");
-		printf("# x2   number of fragments of length j with a 3' G->A \n");
-		printf("# x3   number of fragments of length j with a 5' C->T \n");
-		printf("# x4   number of fragments of length j with a 3' G->A \n");
+		fprintf(fp, "#FL\tj\tk\tx1\tx2\tx3\tx4\n");
+		fprintf(fp, "# FL  count of fragments with a given length\n");
+		fprintf(fp, "# j   fragment length\n");
+		fprintf(fp, "# k   number of fragments of length j\n");
+		fprintf(fp, "# x1   number of fragments of length j with a 5' C->T \n");
+		fprintf(fp, "# x2   number of fragments of length j with a 3' G->A \n");
+		fprintf(fp, "# x3   number of fragments of length j with a 5' C->T \n");
+		fprintf(fp, "# x4   number of fragments of length j with a 3' G->A \n");
 		for (i=1; i<lmax; i++)
-			printf("FL\t%d\t%zd\t%zd\t%zd\t%zd\t%zd\n", i, (uintmax_t)lhist[i],
+			fprintf(fp, "FL\t%d\t%zd\t%zd\t%zd\t%zd\t%zd\n", i, (uintmax_t)lhist[i],
 					(uintmax_t)lhist_cond[i<<2 | _5C2T],
 					(uintmax_t)lhist_cond[i<<2 | _3C2T],
 					(uintmax_t)lhist_cond[i<<2 | _5G2A],
 					(uintmax_t)lhist_cond[i<<2 | _3G2A]);
 	}
 
+	free(lhist_cond);
+	free(lhist);
+	free(counts3);
+	free(counts5);
+	return 0;
+}
+
+/*
+ * Open the input file.  CRAM input is decoded against ref.fasta, the
+ * same reference used for scanning, and only the fields that are needed
+ * for scanning are decoded, unless reads are to be written with -o.
+ */
+static samFile *
+open_input(const opt_t *opt)
+{
+	samFile *fp = sam_open(opt->bam_fn, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "bam_open: %s: %s\n", opt->bam_fn, strerror(errno));
+		return NULL;
+	}
+
+	if (hts_get_format(fp)->format != cram)
+		return fp;
+
+	if (opt->fasta_fn && hts_set_fai_filename(fp, opt->fasta_fn) < 0) {
+		fprintf(stderr, "%s: failed to set CRAM reference `%s'\n",
+				opt->bam_fn, opt->fasta_fn);
+		goto err;
+	}
+
+	if (opt->bam_ofn == NULL) {
+		int fields = SAM_FLAG | SAM_RNAME | SAM_POS | SAM_CIGAR | SAM_SEQ;
+		if (opt->use_md)
+			fields |= SAM_AUX;
+		if (hts_set_opt(fp, CRAM_OPT_REQUIRED_FIELDS, fields) < 0) {
+			fprintf(stderr, "%s: failed to set CRAM required fields\n", opt->bam_fn);
+			goto err;
+		}
+	}
+
+	return fp;
+err:
+	sam_close(fp);
+	return NULL;
+}
+
+/*
+ * Input readahead (-B).  A helper thread keeps the input file read ahead
+ * of the scan, by up to `window' bytes, so the data is already in the
+ * page cache when htslib asks for it.  This hides the per-request latency
+ * of networked filesystems.  With io_uring, many large reads are kept in
+ * flight at once.  Otherwise, posix_fadvise() hints are given for the
+ * whole window, and the window is read with large pread() calls.
+ */
+#define RA_CHUNK (4*1024*1024) // bytes per read
+#define RA_DEPTH 8 // reads in flight, with io_uring
+
+typedef struct {
+	int fd;
+	off_t size;
+	off_t window;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	off_t consumed; // the scan's position in the file
+	off_t issued; // end of the reads issued so far
+	int stop;
+
+	uint8_t *buf; // scratch space for the reads, which are discarded
+	pthread_t thread;
+} readahead_t;
+
+/*
+ * Claim the next chunk of the window to read, returning its length.
+ * If wait is set, wait for the scan to make room in the window first.
+ * Returns 0 when finished, or when the window is full and !wait.
+ */
+static size_t
+readahead_claim(readahead_t *ra, off_t *off, int wait)
+{
+	size_t len = 0;
+
+	pthread_mutex_lock(&ra->lock);
+	while (wait && !ra->stop && ra->issued < ra->size
+			&& ra->issued >= ra->consumed + ra->window)
+		pthread_cond_wait(&ra->cond, &ra->lock);
+	if (!ra->stop && ra->issued < ra->consumed + ra->window
+			&& ra->issued < ra->size) {
+		off_t end = ra->consumed + ra->window;
+		if (end > ra->size)
+			end = ra->size;
+		if (end > ra->issued + RA_CHUNK)
+			end = ra->issued + RA_CHUNK;
+		*off = ra->issued;
+		len = end - ra->issued;
+		ra->issued = end;
+	}
+	pthread_mutex_unlock(&ra->lock);
+
+	return len;
+}
+
+#ifdef HAVE_LIBURING
+static void *
+readahead_run(void *arg)
+{
+	readahead_t *ra = arg;
+	struct io_uring ring;
+	struct io_uring_cqe *cqe;
+	int slots[RA_DEPTH]; // free buffer slots
+	int i, n_free = RA_DEPTH;
+
+	if (io_uring_queue_init(RA_DEPTH, &ring, 0) < 0)
+		return NULL;
+
+	for (i=0; i<RA_DEPTH; i++)
+		slots[i] = i;
+
+	for (;;) {
+		// keep the queue full, only blocking when nothing is in flight
+		while (n_free > 0) {
+			off_t off;
+			size_t len = readahead_claim(ra, &off, n_free == RA_DEPTH);
+			if (len == 0)
+				break;
+			int slot = slots[--n_free];
+			struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+			io_uring_prep_read(sqe, ra->fd, ra->buf + (size_t)slot*RA_CHUNK, len, off);
+			io_uring_sqe_set_data(sqe, (void *)(intptr_t)slot);
+		}
+		if (n_free == RA_DEPTH)
+			break;
+
+		if (io_uring_submit_and_wait(&ring, 1) < 0)
+			break;
+		while (io_uring_peek_cqe(&ring, &cqe) == 0) {
+			slots[n_free++] = (intptr_t)io_uring_cqe_get_data(cqe);
+			io_uring_cqe_seen(&ring, cqe);
+		}
+	}
+
+	// drain, so the buffers aren't freed under the kernel
+	while (n_free < RA_DEPTH && io_uring_wait_cqe(&ring, &cqe) == 0) {
+		io_uring_cqe_seen(&ring, cqe);
+		n_free++;
+	}
+	io_uring_queue_exit(&ring);
+	return NULL;
+}
+#else
+static void *
+readahead_run(void *arg)
+{
+	readahead_t *ra = arg;
+	off_t off;
+	size_t len;
+
+	while ((len = readahead_claim(ra, &off, 1)) > 0) {
+		posix_fadvise(ra->fd, off, ra->window, POSIX_FADV_WILLNEED);
+		while (len > 0) {
+			ssize_t r = pread(ra->fd, ra->buf, len, off);
+			if (r <= 0)
+				return NULL;
+			off += r;
+			len -= r;
+		}
+	}
+
+	return NULL;
+}
+#endif
+
+/*
+ * Start reading fn ahead, by up to window bytes.
+ * Returns NULL if readahead isn't possible for this file.
+ */
+static readahead_t *
+readahead_start(const char *fn, size_t window)
+{
+	readahead_t *ra;
+	struct stat st;
+
+	ra = calloc(1, sizeof(*ra));
+	if (ra == NULL)
+		goto err0;
+
+	ra->fd = open(fn, O_RDONLY);
+	if (ra->fd < 0 || fstat(ra->fd, &st) < 0 || !S_ISREG(st.st_mode))
+		goto err1;
+	ra->size = st.st_size;
+	ra->window = window;
+	posix_fadvise(ra->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+#ifdef HAVE_LIBURING
+	ra->buf = malloc((size_t)RA_DEPTH*RA_CHUNK);
+#else
+	ra->buf = malloc(RA_CHUNK);
+#endif
+	if (ra->buf == NULL)
+		goto err1;
+
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->cond, NULL);
+
+	if (pthread_create(&ra->thread, NULL, readahead_run, ra) != 0)
+		goto err2;
+
+	return ra;
+err2:
+	pthread_cond_destroy(&ra->cond);
+	pthread_mutex_destroy(&ra->lock);
+	free(ra->buf);
+err1:
+	if (ra->fd >= 0)
+		close(ra->fd);
+	free(ra);
+err0:
+	return NULL;
+}
+
+/*
+ * Tell the readahead thread how far the scan has got.
+ */
+static void
+readahead_update(readahead_t *ra, off_t consumed)
+{
+	if (ra == NULL)
+		return;
+	pthread_mutex_lock(&ra->lock);
+	if (consumed > ra->consumed) {
+		ra->consumed = consumed;
+		pthread_cond_signal(&ra->cond);
+	}
+	pthread_mutex_unlock(&ra->lock);
+}
+
+static void
+readahead_stop(readahead_t *ra)
+{
+	if (ra == NULL)
+		return;
+	pthread_mutex_lock(&ra->lock);
+	ra->stop = 1;
+	pthread_cond_signal(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+
+	pthread_join(ra->thread, NULL);
+	pthread_cond_destroy(&ra->cond);
+	pthread_mutex_destroy(&ra->lock);
+	free(ra->buf);
+	close(ra->fd);
+	free(ra);
+}
+
+/*
+ * A chunk of the genome, made up of one or more regions, which is scanned
+ * by a single worker when running in parallel (-p).
+ */
+typedef struct {
+	int tid;
+	int beg, end;
+} region_t;
+
+typedef struct {
+	region_t *regions;
+	int n_regions;
+} chunk_t;
+
+// Aim for this many chunks per worker, to balance the load.
+#define CHUNKS_PER_WORKER 8
+// Limit the number of reads in a chunk, so a worker that's ahead of
+// the output doesn't wait long for a slow chunk before it.
+#define CHUNK_MAX_READS (1<<20)
+
+static void
+chunks_free(chunk_t *chunks, int n_chunks)
+{
+	int i;
+
+	for (i=0; i<n_chunks; i++)
+		free(chunks[i].regions);
+	free(chunks);
+}
+
+static int
+chunk_add_region(chunk_t *ck, int tid, int beg, int end)
+{
+	region_t *tmp = realloc(ck->regions, (ck->n_regions+1)*sizeof(*tmp));
+	if (tmp == NULL) {
+		perror("realloc:chunk_add_region");
+		return -1;
+	}
+	ck->regions = tmp;
+	ck->regions[ck->n_regions].tid = tid;
+	ck->regions[ck->n_regions].beg = beg;
+	ck->regions[ck->n_regions].end = end;
+	ck->n_regions++;
+	return 0;
+}
+
+static chunk_t *
+chunk_new(chunk_t **chunks, int *n_chunks)
+{
+	chunk_t *tmp = realloc(*chunks, (*n_chunks+1)*sizeof(*tmp));
+	if (tmp == NULL) {
+		perror("realloc:chunk_new");
+		return NULL;
+	}
+	*chunks = tmp;
+	memset(&tmp[*n_chunks], 0, sizeof(*tmp));
+	return &tmp[(*n_chunks)++];
+}
+
+/*
+ * Split the genome into chunks with approximately equal numbers of
+ * mapped reads, according to the bam index.  Large contigs are split
+ * into multiple chunks, and small contigs are grouped together.
+ * If the index has no read counts, contig lengths are used instead.
+ * Returns the number of chunks, or -1 on error.
+ */
+static int
+make_chunks(hts_idx_t *idx, bam_hdr_t *bam_hdr, int nworkers, chunk_t **chunks_out)
+{
+	chunk_t *chunks = NULL, *ck;
+	int n_chunks = 0;
+	int cur = -1; // chunk for grouping small contigs
+	uint64_t *weight, total = 0, target, acc = 0;
+	int have_stats = 1;
+	int tid;
+
+	weight = malloc(bam_hdr->n_targets * sizeof(*weight));
+	if (weight == NULL) {
+		perror("malloc:make_chunks");
+		return -1;
+	}
+
+	for (tid=0; tid<bam_hdr->n_targets; tid++) {
+		uint64_t mapped, unmapped;
+		if (hts_idx_get_stat(idx, tid, &mapped, &unmapped) < 0) {
+			have_stats = 0;
+			break;
+		}
+		weight[tid] = mapped;
+	}
+	if (!have_stats) {
+		for (tid=0; tid<bam_hdr->n_targets; tid++)
+			weight[tid] = bam_hdr->target_len[tid];
+	}
+
+	for (tid=0; tid<bam_hdr->n_targets; tid++)
+		total += weight[tid];
+
+	target = total / (nworkers * CHUNKS_PER_WORKER);
+	if (have_stats && target > CHUNK_MAX_READS)
+		target = CHUNK_MAX_READS;
+	if (target == 0)
+		target = 1;
+
+	for (tid=0; tid<bam_hdr->n_targets; tid++) {
+		int len = bam_hdr->target_len[tid];
+
+		if (weight[tid] == 0 || len == 0)
+			// nothing to do here
+			continue;
+
+		if (weight[tid] > target) {
+			// split the contig
+			int k = (weight[tid] + target - 1) / target;
+			int step = (len + k - 1) / k;
+			int beg;
+
+			for (beg=0; beg<len; beg+=step) {
+				int end = beg+step < len ? beg+step : len;
+				ck = chunk_new(&chunks, &n_chunks);
+				if (ck == NULL)
+					goto err;
+				if (chunk_add_region(ck, tid, beg, end) < 0)
+					goto err;
+			}
+			cur = -1;
+		} else {
+			// group small contigs
+			if (cur == -1) {
+				ck = chunk_new(&chunks, &n_chunks);
+				if (ck == NULL)
+					goto err;
+				cur = n_chunks-1;
+				acc = 0;
+			}
+			if (chunk_add_region(&chunks[cur], tid, 0, len) < 0)
+				goto err;
+			acc += weight[tid];
+			if (acc >= target)
+				cur = -1;
+		}
+	}
+
+	free(weight);
+	*chunks_out = chunks;
+	return n_chunks;
+err:
+	chunks_free(chunks, n_chunks);
+	free(weight);
+	return -1;
+}
+
+/*
+ * Ordered writer for the parallel scans.  The work is split into units
+ * (chunks of the genome, or jobs of BGZF blocks), numbered in input order.
+ * Workers hand over the selected reads of a unit in slices, and a writer
+ * thread writes them to bam_ofp in unit order, so the workers never wait
+ * on the output file.  A worker whose unit isn't the one being written
+ * waits while too many reads are queued, so memory use is bounded.
+ */
+#define OWR_SLICE 4096 // reads per slice
+#define OWR_MAX_QUEUED (64*OWR_SLICE)
+
+typedef struct oslice_t {
+	int unit;
+	int last; // last slice of the unit
+	bam1_t **b;
+	int n;
+	struct oslice_t *next;
+} oslice_t;
+
+typedef struct {
+	const opt_t *opt;
+	samFile *bam_ofp;
+	bam_hdr_t *bam_ohdr;
+	pthread_t thread;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	oslice_t *head, *tail;
+	size_t n_queued; // reads in the queue
+	int next; // unit being written
+	int stop;
+	int err;
+} owriter_t;
+
+static void
+oslice_free(oslice_t *sl)
+{
+	int i;
+
+	for (i=0; i<sl->n; i++)
+		bam_destroy1(sl->b[i]);
+	free(sl->b);
+	free(sl);
+}
+
+/*
+ * Take the next slice of unit w->next from the queue, waiting for it if
+ * necessary.  Returns NULL once stopped and there's nothing left to write.
+ */
+static oslice_t *
+owriter_get(owriter_t *w)
+{
+	oslice_t *sl = NULL, *prev;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		for (prev = NULL, sl = w->head; sl; prev = sl, sl = sl->next) {
+			if (sl->unit == w->next)
+				break;
+		}
+		if (sl || w->stop || w->err)
+			break;
+		pthread_cond_wait(&w->cond, &w->lock);
+	}
+	if (sl && !w->err) {
+		if (prev)
+			prev->next = sl->next;
+		else
+			w->head = sl->next;
+		if (w->tail == sl)
+			w->tail = prev;
+		w->n_queued -= sl->n;
+		pthread_cond_broadcast(&w->cond);
+	} else {
+		sl = NULL;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return sl;
+}
+
+static void *
+owriter_run(void *arg)
+{
+	owriter_t *w = arg;
+	oslice_t *sl;
+	int i;
+
+	while ((sl = owriter_get(w)) != NULL) {
+		for (i=0; i<sl->n; i++) {
+			if (sam_write1(w->bam_ofp, w->bam_ohdr, sl->b[i]) < 0) {
+				fprintf(stderr, "sam_write1: %s: write failed\n", w->opt->bam_ofn);
+				pthread_mutex_lock(&w->lock);
+				w->err = 1;
+				pthread_cond_broadcast(&w->cond);
+				pthread_mutex_unlock(&w->lock);
+				oslice_free(sl);
+				return NULL;
+			}
+		}
+		pthread_mutex_lock(&w->lock);
+		if (sl->last) {
+			w->next++;
+			pthread_cond_broadcast(&w->cond);
+		}
+		pthread_mutex_unlock(&w->lock);
+		oslice_free(sl);
+	}
+
+	return NULL;
+}
+
+static int
+owriter_start(owriter_t *w, const opt_t *opt, samFile *bam_ofp, bam_hdr_t *bam_ohdr)
+{
+	memset(w, 0, sizeof(*w));
+	w->opt = opt;
+	w->bam_ofp = bam_ofp;
+	w->bam_ohdr = bam_ohdr;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	if (pthread_create(&w->thread, NULL, owriter_run, w) != 0) {
+		fprintf(stderr, "pthread_create: failed to start writer\n");
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Queue n reads b[] for unit `unit', taking ownership of b and the reads.
+ * last marks the unit's final slice, which may be empty.
+ * Returns -1 if the writer failed or was aborted.
+ */
+static int
+owriter_put(owriter_t *w, int unit, bam1_t **b, int n, int last)
+{
+	oslice_t *sl = malloc(sizeof(*sl));
+	int i, ret = 0;
+
+	if (sl == NULL) {
+		fprintf(stderr, "owriter_put: failed to allocate memory\n");
+		for (i=0; i<n; i++)
+			bam_destroy1(b[i]);
+		free(b);
+		return -1;
+	}
+	sl->unit = unit;
+	sl->last = last;
+	sl->b = b;
+	sl->n = n;
+	sl->next = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	while (w->n_queued >= OWR_MAX_QUEUED && unit != w->next && !w->err)
+		pthread_cond_wait(&w->cond, &w->lock);
+	if (w->err) {
+		ret = -1;
+	} else {
+		if (w->tail)
+			w->tail->next = sl;
+		else
+			w->head = sl;
+		w->tail = sl;
+		w->n_queued += n;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	if (ret < 0)
+		oslice_free(sl);
+	return ret;
+}
+
+/*
+ * Stop the writer, discarding whatever hasn't been written.
+ */
+static void
+owriter_abort(owriter_t *w)
+{
+	pthread_mutex_lock(&w->lock);
+	w->err = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Wait for the writer to write everything queued, and free it.
+ * Returns -1 if it failed.
+ */
+static int
+owriter_finish(owriter_t *w)
+{
+	oslice_t *sl, *next;
+	int ret;
+
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+
+	ret = w->err ? -1 : 0;
+	for (sl = w->head; sl; sl = next) {
+		next = sl->next;
+		oslice_free(sl);
+		ret = -1;
+	}
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+	return ret;
+}
+
+/*
+ * A worker's slice of selected reads, being filled for the ordered writer.
+ */
+typedef struct {
+	bam1_t **b;
+	int n;
+} oslice_buf_t;
+
+/*
+ * Add a copy of b to the worker's slice, handing the slice to the writer
+ * when it's full.
+ */
+static int
+oslice_add(owriter_t *w, oslice_buf_t *ob, int unit, const bam1_t *b)
+{
+	if (ob->b == NULL) {
+		ob->b = malloc(OWR_SLICE * sizeof(*ob->b));
+		if (ob->b == NULL) {
+			fprintf(stderr, "oslice_add: failed to allocate memory\n");
+			return -1;
+		}
+	}
+	ob->b[ob->n] = bam_dup1(b);
+	if (ob->b[ob->n] == NULL) {
+		fprintf(stderr, "bam_dup1: failed to allocate memory\n");
+		return -1;
+	}
+	if (++ob->n == OWR_SLICE) {
+		bam1_t **full = ob->b;
+		ob->b = NULL;
+		ob->n = 0;
+		return owriter_put(w, unit, full, OWR_SLICE, 0);
+	}
+	return 0;
+}
+
+/*
+ * Hand the rest of the unit's reads to the writer.
+ */
+static int
+oslice_end(owriter_t *w, oslice_buf_t *ob, int unit)
+{
+	bam1_t **b = ob->b;
+	int n = ob->n;
+
+	ob->b = NULL;
+	ob->n = 0;
+	return owriter_put(w, unit, b, n, 1);
+}
+
+/*
+ * Discard a partly filled slice, after an error.
+ */
+static void
+oslice_discard(oslice_buf_t *ob)
+{
+	int i;
+
+	for (i=0; i<ob->n; i++)
+		bam_destroy1(ob->b[i]);
+	free(ob->b);
+	ob->b = NULL;
+	ob->n = 0;
+}
+
+/*
+ * State shared between the workers.
+ */
+typedef struct {
+	const opt_t *opt;
+	bam_hdr_t *bam_hdr;
+	owriter_t *owr; // NULL without -o
+
+	pthread_mutex_t lock;
+	chunk_t *chunks;
+	int n_chunks;
+	int next; // next chunk to be scanned
+	int err;
+} dispatch_t;
+
+typedef struct {
+	dispatch_t *d;
+	samFile *bam_fp;
+	bam_hdr_t *bam_hdr;
+	hts_idx_t *idx;
+	refseq_t rs;
+	damage_t dmg;
+	bam1_t *b;
+	oslice_buf_t out; // selected reads of the current chunk
+	pthread_t thread;
+} worker_t;
+
+static int
+worker_init(worker_t *w, dispatch_t *d)
+{
+	const opt_t *opt = d->opt;
+
+	w->d = d;
+
+	if (damage_init(&w->dmg, opt) < 0)
+		goto err0;
+
+	w->bam_fp = open_input(opt);
+	if (w->bam_fp == NULL)
+		goto err1;
+
+	w->bam_hdr = sam_hdr_read(w->bam_fp);
+	if (w->bam_hdr == NULL) {
+		fprintf(stderr, "%s: couldn't read header\n", opt->bam_fn);
+		goto err2;
+	}
+
+	w->idx = sam_index_load(w->bam_fp, opt->bam_fn);
+	if (w->idx == NULL) {
+		fprintf(stderr, "%s: couldn't load index\n", opt->bam_fn);
+		goto err3;
+	}
+
+	if (refseq_init(&w->rs, opt) < 0)
+		goto err4;
+
+	w->b = bam_init1();
+	if (w->b == NULL)
+		goto err5;
+
+	return 0;
+err5:
+	refseq_destroy(&w->rs);
+err4:
+	hts_idx_destroy(w->idx);
+err3:
+	bam_hdr_destroy(w->bam_hdr);
+err2:
+	sam_close(w->bam_fp);
+err1:
+	damage_free(&w->dmg);
+err0:
+	return -1;
+}
+
+static void
+worker_destroy(worker_t *w)
+{
+	oslice_discard(&w->out);
+	bam_destroy1(w->b);
+	refseq_destroy(&w->rs);
+	hts_idx_destroy(w->idx);
+	bam_hdr_destroy(w->bam_hdr);
+	sam_close(w->bam_fp);
+	damage_free(&w->dmg);
+}
+
+/*
+ * Scan chunk i, handing its selected reads to the ordered writer.
+ */
+static int
+scan_chunk(worker_t *w, int i_chunk)
+{
+	chunk_t *ck = &w->d->chunks[i_chunk];
+	dispatch_t *d = w->d;
+	int i, r;
+
+	for (i=0; i<ck->n_regions; i++) {
+		region_t *reg = &ck->regions[i];
+		hts_itr_t *itr = sam_itr_queryi(w->idx, reg->tid, reg->beg, reg->end);
+		if (itr == NULL) {
+			fprintf(stderr, "%s: failed to query region %s:%d-%d\n",
+					d->opt->bam_fn, d->bam_hdr->target_name[reg->tid],
+					reg->beg+1, reg->end);
+			return -1;
+		}
+
+		while ((r = sam_itr_next(w->bam_fp, itr, w->b)) >= 0) {
+			if (w->b->core.pos < reg->beg)
+				// overlaps the region, but was scanned with the previous chunk
+				continue;
+
+			int b_out = scan_read(d->opt, &w->dmg, &w->rs, d->bam_hdr, w->b);
+			if (b_out < 0) {
+				hts_itr_destroy(itr);
+				return -1;
+			}
+
+			if (d->owr && b_out && oslice_add(d->owr, &w->out, i_chunk, w->b) < 0) {
+				hts_itr_destroy(itr);
+				return -1;
+			}
+		}
+
+		hts_itr_destroy(itr);
+
+		if (r < -1) {
+			fprintf(stderr, "sam_itr_next: %s: read failed\n", d->opt->bam_fn);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void *
+worker_run(void *arg)
+{
+	worker_t *w = arg;
+	dispatch_t *d = w->d;
+
+	for (;;) {
+		int i;
+
+		pthread_mutex_lock(&d->lock);
+		if (d->err || d->next == d->n_chunks) {
+			pthread_mutex_unlock(&d->lock);
+			break;
+		}
+		i = d->next++;
+		pthread_mutex_unlock(&d->lock);
+
+		int r = scan_chunk(w, i);
+		if (r == 0 && d->owr)
+			r = oslice_end(d->owr, &w->out, i);
+
+		if (r < 0) {
+			oslice_discard(&w->out);
+			pthread_mutex_lock(&d->lock);
+			d->err = 1;
+			pthread_mutex_unlock(&d->lock);
+			if (d->owr)
+				owriter_abort(d->owr);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Block parallel scanning, for BAMs without an index.  The compressed
+ * BGZF blocks are read sequentially, a job of BLK_JOB_BLOCKS blocks at
+ * a time, and each job is inflated, parsed and scanned by a worker.
+ * The partial record at the end of each job is carried over to the
+ * next job in order, so records that span jobs are stitched together.
+ */
+#define BLK_JOB_BLOCKS 64
+#define BGZF_HDR_LEN 12 // fixed part of the gzip header
+#define BGZF_MAX_BLOCK_LEN 0x10000
+
+typedef struct {
+	const opt_t *opt;
+	bam_hdr_t *bam_hdr;
+	owriter_t *owr; // NULL without -o
+	FILE *fp; // the compressed bam, positioned at the next block
+	readahead_t *ra;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int next; // next job to be read
+	int next_stitch; // next job to take the carried partial record
+	int eof;
+	int err;
+
+	size_t skip; // header bytes at the start of the first job
+	uint8_t *carry; // partial record at the end of the last stitched job
+	size_t l_carry, m_carry;
+} blk_dispatch_t;
+
+typedef struct {
+	blk_dispatch_t *d;
+	refseq_t rs;
+	damage_t dmg;
+	z_stream zs;
+	bam1_t *b;
+	pthread_t thread;
+
+	int seq; // job sequence number
+	uint8_t *cdata; // compressed blocks
+	size_t l_cdata, m_cdata;
+	uint8_t *udata; // inflated blocks
+	size_t l_udata, m_udata;
+	uint8_t *span; // the record that spans the previous job and this one
+	size_t l_span, m_span;
+	size_t rec_beg, rec_end; // whole records in udata
+
+	oslice_buf_t out; // selected reads of the current job
+} blk_worker_t;
+
+/*
+ * Make room for n bytes in buf.
+ */
+static int
+buf_reserve(uint8_t **buf, size_t *m, size_t n)
+{
+	if (n > *m) {
+		size_t m2 = *m ? *m : 1024;
+		while (m2 < n)
+			m2 *= 2;
+		uint8_t *tmp = realloc(*buf, m2);
+		if (tmp == NULL)
+			return -1;
+		*buf = tmp;
+		*m = m2;
+	}
+	return 0;
+}
+
+/*
+ * Length of the extra field for a BGZF block header, or -1 if the
+ * header isn't valid.
+ */
+static int
+bgzf_xlen(const uint8_t *h)
+{
+	if (h[0] != 31 || h[1] != 139 || h[2] != 8 || !(h[3] & 4))
+		return -1;
+	return h[10] | h[11]<<8;
+}
+
+/*
+ * Total length of a BGZF block, from its header and extra field,
+ * or -1 if there's no BC subfield.
+ */
+static int
+bgzf_block_len(const uint8_t *h, int xlen)
+{
+	const uint8_t *x = h + BGZF_HDR_LEN;
+	int i = 0;
+
+	while (i + 4 <= xlen) {
+		int slen = x[i+2] | x[i+3]<<8;
+		if (x[i] == 'B' && x[i+1] == 'C' && slen == 2 && i + 6 <= xlen)
+			return (x[i+4] | x[i+5]<<8) + 1;
+		i += 4 + slen;
+	}
+	return -1;
+}
+
+/*
+ * Read the compressed blocks for the next job.  The caller must hold
+ * d->lock.  Returns the number of blocks read, or -1 on error.
+ */
+static int
+blk_read_job(blk_dispatch_t *d, blk_worker_t *w)
+{
+	int n;
+
+	w->l_cdata = 0;
+	for (n=0; n<BLK_JOB_BLOCKS; n++) {
+		uint8_t *h;
+		int xlen, len;
+
+		if (buf_reserve(&w->cdata, &w->m_cdata, w->l_cdata + BGZF_MAX_BLOCK_LEN) < 0) {
+			fprintf(stderr, "blk_read_job: failed to allocate memory\n");
+			return -1;
+		}
+		h = w->cdata + w->l_cdata;
+
+		size_t r = fread(h, 1, BGZF_HDR_LEN, d->fp);
+		if (r == 0 && feof(d->fp)) {
+			d->eof = 1;
+			break;
+		}
+		if (r != BGZF_HDR_LEN || (xlen = bgzf_xlen(h)) < 0
+				|| xlen > BGZF_MAX_BLOCK_LEN - BGZF_HDR_LEN - 8
+				|| fread(h+BGZF_HDR_LEN, 1, xlen, d->fp) != xlen
+				|| (len = bgzf_block_len(h, xlen)) < BGZF_HDR_LEN+xlen+8
+				|| fread(h+BGZF_HDR_LEN+xlen, 1, len-BGZF_HDR_LEN-xlen, d->fp)
+					!= len-BGZF_HDR_LEN-xlen) {
+			fprintf(stderr, "%s: invalid or truncated BGZF block\n", d->opt->bam_fn);
+			return -1;
+		}
+		w->l_cdata += len;
+	}
+
+	readahead_update(d->ra, ftello(d->fp));
+	return n;
+}
+
+/*
+ * Inflate the job's blocks into udata.
+ */
+static int
+blk_inflate(blk_worker_t *w)
+{
+	const char *fn = w->d->opt->bam_fn;
+	size_t i = 0;
+
+	w->l_udata = 0;
+	while (i < w->l_cdata) {
+		const uint8_t *h = w->cdata + i;
+		int xlen = bgzf_xlen(h);
+		int len = bgzf_block_len(h, xlen);
+		const uint8_t *tail = h + len - 8;
+		uint32_t crc = le_to_u32(tail);
+		uint32_t isize = le_to_u32(tail + 4);
+
+		if (isize == 0) {
+			// an empty block, such as the EOF marker, has nothing to
+			// inflate, and udata may not have been allocated yet
+			if (crc != 0) {
+				fprintf(stderr, "%s: corrupt BGZF block\n", fn);
+				return -1;
+			}
+			i += len;
+			continue;
+		}
+
+		if (isize > BGZF_MAX_BLOCK_LEN
+				|| buf_reserve(&w->udata, &w->m_udata, w->l_udata + isize) < 0) {
+			fprintf(stderr, "%s: invalid BGZF block size\n", fn);
+			return -1;
+		}
+
+		uint8_t *out = w->udata + w->l_udata;
+		if (inflateReset(&w->zs) != Z_OK)
+			return -1;
+		w->zs.next_in = (Bytef *)h + BGZF_HDR_LEN + xlen;
+		w->zs.avail_in = len - BGZF_HDR_LEN - xlen - 8;
+		w->zs.next_out = out;
+		w->zs.avail_out = isize;
+		if (inflate(&w->zs, Z_FINISH) != Z_STREAM_END || w->zs.total_out != isize
+				|| crc32(crc32(0L, NULL, 0), out, isize) != crc) {
+			fprintf(stderr, "%s: corrupt BGZF block\n", fn);
+			return -1;
+		}
+
+		w->l_udata += isize;
+		i += len;
+	}
+
+	return 0;
+}
+
+/*
+ * Take the partial record carried from the previous job, and complete it
+ * from the start of this job.  Then find the whole records in this job,
+ * and carry over the remainder.  The caller must hold d->lock.
+ */
+static int
+blk_stitch(blk_dispatch_t *d, blk_worker_t *w)
+{
+	const uint8_t *u = w->udata;
+	size_t n = w->l_udata;
+	size_t off = 0;
+
+	if (d->skip) {
+		off = d->skip < n ? d->skip : n;
+		d->skip -= off;
+	}
+
+	w->l_span = 0;
+	if (d->l_carry) {
+		size_t have = d->l_carry;
+		uint8_t len4[4];
+		size_t i;
+
+		for (i=0; i<4 && i<have; i++)
+			len4[i] = d->carry[i];
+		for (; i<4 && off+i-have < n; i++)
+			len4[i] = u[off+i-have];
+
+		size_t need = i < 4 ? SIZE_MAX : 4 + le_to_u32(len4) - have;
+		if (need > n - off) {
+			// the record continues into the next job
+			if (buf_reserve(&d->carry, &d->m_carry, have + n - off) < 0)
+				return -1;
+			memcpy(d->carry + have, u + off, n - off);
+			d->l_carry += n - off;
+			w->rec_beg = w->rec_end = n;
+			return 0;
+		}
+
+		if (buf_reserve(&w->span, &w->m_span, have + need) < 0)
+			return -1;
+		memcpy(w->span, d->carry, have);
+		memcpy(w->span + have, u + off, need);
+		w->l_span = have + need;
+		off += need;
+		d->l_carry = 0;
+	}
+
+	w->rec_beg = off;
+	while (n - off >= 4 && n - off - 4 >= le_to_u32(u + off))
+		off += 4 + le_to_u32(u + off);
+	w->rec_end = off;
+
+	if (buf_reserve(&d->carry, &d->m_carry, n - off) < 0)
+		return -1;
+	memcpy(d->carry, u + off, n - off);
+	d->l_carry = n - off;
+
+	return 0;
+}
+
+/*
+ * Move a CIGAR of more than 65535 operations out of the CG tag and into
+ * place, as sam_read1() does.  Such a record has a placeholder CIGAR,
+ * kSmN for a read of length k.  Returns -1 if the CG tag is truncated.
+ */
+static int
+bam_expand_cg(bam1_t *b)
+{
+	bam1_core_t *c = &b->core;
+	const uint32_t *cigar = bam_get_cigar(b);
+	size_t cigar_st, rest_st, cg_st, cg_en, l_data;
+	uint8_t *cg, *data;
+	uint32_t n, i;
+
+	if (c->n_cigar == 0 || c->tid < 0 || c->pos < 0
+			|| bam_cigar_op(cigar[0]) != BAM_CSOFT_CLIP
+			|| bam_cigar_oplen(cigar[0]) != c->l_qseq)
+		return 0;
+	cg = bam_aux_get(b, "CG");
+	if (cg == NULL || cg[0] != 'B' || (cg[1] != 'I' && cg[1] != 'i'))
+		return 0;
+	if (cg + 6 > b->data + b->l_data)
+		return -1;
+	n = le_to_u32(cg + 2);
+	if (n < c->n_cigar || n >= 1U<<29)
+		return 0;
+
+	cigar_st = (const uint8_t *)cigar - b->data;
+	rest_st = cigar_st + 4*(size_t)c->n_cigar; // seq, qual and aux
+	cg_st = cg - 2 - b->data;
+	cg_en = cg_st + 8 + 4*(size_t)n;
+	if (cg_en > b->l_data)
+		return -1;
+
+	// the real CIGAR replaces the placeholder, and the CG tag is dropped
+	l_data = b->l_data - 4*(size_t)c->n_cigar - 8;
+	data = malloc(l_data);
+	if (data == NULL)
+		return -1;
+	memcpy(data, b->data, cigar_st);
+	for (i=0; i<n; i++)
+		((uint32_t *)(data + cigar_st))[i] = le_to_u32(cg + 6 + 4*i);
+	memcpy(data + cigar_st + 4*(size_t)n, b->data + rest_st, cg_st - rest_st);
+	memcpy(data + cigar_st + 4*(size_t)n + cg_st - rest_st, b->data + cg_en, b->l_data - cg_en);
+
+	free(b->data);
+	b->data = data;
+	b->l_data = b->m_data = l_data;
+	c->n_cigar = n;
+	return 0;
+}
+
+/*
+ * Decode the bam record at p, starting with its block_size field, and with
+ * len bytes available.  CIGARs with more than 65535 operations, which are
+ * stored in the CG tag, are moved into place.  Records are checked
+ * as sam_read1() checks them, so a corrupt record is rejected here rather
+ * than indexing past the end of the header's targets.
+ */
+static int
+bam_parse_record(bam1_t *b, const bam_hdr_t *bam_hdr, const uint8_t *p, size_t len)
+{
+	bam1_core_t *c = &b->core;
+	uint32_t block_len = le_to_u32(p);
+	uint32_t x;
+
+	if (block_len < 32 || len < 4 + (size_t)block_len)
+		return -1;
+
+	c->tid = le_to_i32(p+4);
+	c->pos = le_to_i32(p+8);
+	x = le_to_u32(p+12);
+	c->bin = x >> 16;
+	c->qual = x >> 8 & 0xff;
+	int l_read_name = x & 0xff;
+	x = le_to_u32(p+16);
+	c->flag = x >> 16;
+	c->n_cigar = x & 0xffff;
+	c->l_qseq = le_to_i32(p+20);
+	c->mtid = le_to_i32(p+24);
+	c->mpos = le_to_i32(p+28);
+	c->isize = le_to_i32(p+32);
+
+	if (c->tid < -1 || c->tid >= bam_hdr->n_targets
+			|| c->mtid < -1 || c->mtid >= bam_hdr->n_targets)
+		return -1;
+
+	size_t l_var = block_len - 32;
+	if (l_read_name == 0 || c->l_qseq < 0
+			|| l_read_name + 4*(size_t)c->n_cigar + (c->l_qseq+1)/2 + c->l_qseq > l_var)
+		return -1;
+
+	// pad the name, so the CIGAR is 4 byte aligned
+	c->l_extranul = (4 - l_read_name % 4) % 4;
+	c->l_qname = l_read_name + c->l_extranul;
+
+	size_t l_data = l_var + c->l_extranul;
+	if (l_data > INT_MAX)
+		return -1;
+	if (l_data > b->m_data) {
+		uint8_t *tmp = realloc(b->data, l_data);
+		if (tmp == NULL)
+			return -1;
+		b->data = tmp;
+		b->m_data = l_data;
+	}
+	memcpy(b->data, p+36, l_read_name);
+	memset(b->data + l_read_name, 0, c->l_extranul);
+	memcpy(b->data + c->l_qname, p+36+l_read_name, l_var - l_read_name);
+	b->l_data = l_data;
+
+	return bam_expand_cg(b);
+}
+
+/*
+ * Parse and scan one record.
+ */
+static int
+blk_scan_record(blk_worker_t *w, const uint8_t *p, size_t len)
+{
+	blk_dispatch_t *d = w->d;
+
+	if (bam_parse_record(w->b, d->bam_hdr, p, len) < 0) {
+		fprintf(stderr, "%s: invalid bam record\n", d->opt->bam_fn);
+		return -1;
+	}
+
+	int b_out = scan_read(d->opt, &w->dmg, &w->rs, d->bam_hdr, w->b);
+	if (b_out < 0)
+		return -1;
+
+	if (d->owr && b_out && oslice_add(d->owr, &w->out, w->seq, w->b) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int
+blk_scan_job(blk_worker_t *w)
+{
+	size_t off;
+
+	if (w->l_span && blk_scan_record(w, w->span, w->l_span) < 0)
+		return -1;
+
+	for (off = w->rec_beg; off < w->rec_end; off += 4 + le_to_u32(w->udata + off)) {
+		if (blk_scan_record(w, w->udata + off, w->rec_end - off) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Wait until it's job seq's turn, as given by *next.
+ * The caller must hold d->lock.  Returns -1 if the scan was aborted.
+ */
+static int
+blk_wait_turn(blk_dispatch_t *d, int *next, int seq)
+{
+	while (*next != seq && !d->err)
+		pthread_cond_wait(&d->cond, &d->lock);
+	return d->err ? -1 : 0;
+}
+
+static void *
+blk_worker_run(void *arg)
+{
+	blk_worker_t *w = arg;
+	blk_dispatch_t *d = w->d;
+	int r;
+
+	for (;;) {
+		pthread_mutex_lock(&d->lock);
+		if (d->err || d->eof) {
+			pthread_mutex_unlock(&d->lock);
+			break;
+		}
+		w->seq = d->next;
+		r = blk_read_job(d, w);
+		if (r > 0)
+			d->next++;
+		else if (r < 0)
+			d->err = 1;
+		pthread_mutex_unlock(&d->lock);
+		if (r <= 0)
+			break;
+
+		r = blk_inflate(w);
+
+		pthread_mutex_lock(&d->lock);
+		if (r < 0 || blk_wait_turn(d, &d->next_stitch, w->seq) < 0
+				|| blk_stitch(d, w) < 0) {
+			d->err = 1;
+			r = -1;
+		} else {
+			d->next_stitch++;
+		}
+		pthread_cond_broadcast(&d->cond);
+		pthread_mutex_unlock(&d->lock);
+
+		if (r == 0)
+			r = blk_scan_job(w);
+		if (r == 0 && d->owr)
+			r = oslice_end(d->owr, &w->out, w->seq);
+
+		if (r < 0) {
+			oslice_discard(&w->out);
+			pthread_mutex_lock(&d->lock);
+			d->err = 1;
+			pthread_cond_broadcast(&d->cond);
+			pthread_mutex_unlock(&d->lock);
+			if (d->owr)
+				owriter_abort(d->owr);
+		}
+	}
+
+	return NULL;
+}
+
+static int
+blk_worker_init(blk_worker_t *w, blk_dispatch_t *d)
+{
+	memset(w, 0, sizeof(*w));
+	w->d = d;
+
+	if (damage_init(&w->dmg, d->opt) < 0)
+		goto err0;
+
+	if (refseq_init(&w->rs, d->opt) < 0)
+		goto err1;
+
+	w->b = bam_init1();
+	if (w->b == NULL)
+		goto err2;
+
+	if (inflateInit2(&w->zs, -15) != Z_OK) {
+		fprintf(stderr, "inflateInit2: failed to initialise zlib\n");
+		goto err3;
+	}
+
+	return 0;
+err3:
+	bam_destroy1(w->b);
+err2:
+	refseq_destroy(&w->rs);
+err1:
+	damage_free(&w->dmg);
+err0:
+	return -1;
+}
+
+static void
+blk_worker_destroy(blk_worker_t *w)
+{
+	oslice_discard(&w->out);
+	free(w->span);
+	free(w->udata);
+	free(w->cdata);
+	inflateEnd(&w->zs);
+	bam_destroy1(w->b);
+	refseq_destroy(&w->rs);
+	damage_free(&w->dmg);
+}
+
+/*
+ * Scan a bam without an index in parallel, by decoding its BGZF blocks
+ * in parallel.  Reads are written to bam_ofp in their input order.
+ */
+static int
+scan_blocks(const opt_t *opt, samFile *bam_fp, bam_hdr_t *bam_hdr,
+		samFile *bam_ofp, bam_hdr_t *bam_ohdr, damage_t *dmg, readahead_t *ra)
+{
+	blk_dispatch_t d;
+	blk_worker_t *workers;
+	owriter_t owr;
+	int nworkers = opt->nthreads > 0 ? opt->nthreads : 1;
+	int i, n_started = 0;
+	int ret;
+
+	const htsFormat *fmt = hts_get_format(bam_fp);
+	if (fmt->format != bam || fmt->compression != bgzf || strcmp(opt->bam_fn, "-") == 0) {
+		fprintf(stderr, "%s: -p requires an indexed file, or a BAM file other than stdin\n",
+				opt->bam_fn);
+		ret = -1;
+		goto err0;
+	}
+
+	// the first record's virtual offset
+	int64_t voff = bgzf_tell(bam_fp->fp.bgzf);
+
+	memset(&d, 0, sizeof(d));
+	d.opt = opt;
+	d.bam_hdr = bam_hdr;
+	d.ra = ra;
+	d.skip = voff & 0xffff;
+	pthread_mutex_init(&d.lock, NULL);
+	pthread_cond_init(&d.cond, NULL);
+
+	d.fp = fopen(opt->bam_fn, "rb");
+	if (d.fp == NULL) {
+		fprintf(stderr, "%s: %s\n", opt->bam_fn, strerror(errno));
+		ret = -2;
+		goto err1;
+	}
+
+	if (voff < 0 || fseeko(d.fp, voff >> 16, SEEK_SET) < 0) {
+		fprintf(stderr, "%s: failed to seek to the first record\n", opt->bam_fn);
+		ret = -3;
+		goto err2;
+	}
+
+	workers = calloc(nworkers, sizeof(*workers));
+	if (workers == NULL) {
+		perror("calloc:workers");
+		ret = -4;
+		goto err2;
+	}
+
+	if (bam_ofp) {
+		if (owriter_start(&owr, opt, bam_ofp, bam_ohdr) < 0) {
+			ret = -4;
+			goto err3;
+		}
+		d.owr = &owr;
+	}
+
+	for (i=0; i<nworkers; i++) {
+		int r = blk_worker_init(&workers[i], &d);
+		if (r == 0 && pthread_create(&workers[i].thread, NULL, blk_worker_run, &workers[i]) != 0) {
+			perror("pthread_create");
+			blk_worker_destroy(&workers[i]);
+			r = -1;
+		}
+		if (r < 0) {
+			pthread_mutex_lock(&d.lock);
+			d.err = 1;
+			pthread_cond_broadcast(&d.cond);
+			pthread_mutex_unlock(&d.lock);
+			if (d.owr)
+				owriter_abort(d.owr);
+			break;
+		}
+		n_started++;
+	}
+
+	for (i=0; i<n_started; i++) {
+		pthread_join(workers[i].thread, NULL);
+		damage_add(dmg, &workers[i].dmg, opt);
+		blk_worker_destroy(&workers[i]);
+	}
+
+	if (d.owr && owriter_finish(d.owr) < 0)
+		d.err = 1;
+
+	if (!d.err && d.l_carry) {
+		fprintf(stderr, "%s: truncated bam record at end of file\n", opt->bam_fn);
+		d.err = 1;
+	}
+
+	ret = d.err ? -5 : 0;
+
+err3:
+	free(workers);
+err2:
+	fclose(d.fp);
+err1:
+	free(d.carry);
+	pthread_cond_destroy(&d.cond);
+	pthread_mutex_destroy(&d.lock);
+err0:
+	return ret;
+}
+
+/*
+ * Scan the bam in parallel, using the bam index idx to split the genome
+ * into chunks.  Each worker accumulates its own counts, which are
+ * added into dmg once all the workers have finished.  Without an index,
+ * the bam's BGZF blocks are decoded in parallel instead, and only then
+ * is the readahead ra used.  Takes ownership of idx.
+ */
+static int
+scan_parallel(const opt_t *opt, samFile *bam_fp, bam_hdr_t *bam_hdr,
+		samFile *bam_ofp, bam_hdr_t *bam_ohdr, damage_t *dmg,
+		hts_idx_t *idx, readahead_t *ra)
+{
+	dispatch_t d;
+	owriter_t owr;
+	worker_t *workers;
+	int nworkers = opt->nthreads > 0 ? opt->nthreads : 1;
+	int i, n_started = 0;
+	int ret;
+
+	if (idx == NULL)
+		return scan_blocks(opt, bam_fp, bam_hdr, bam_ofp, bam_ohdr, dmg, ra);
+
+	memset(&d, 0, sizeof(d));
+	d.opt = opt;
+	d.bam_hdr = bam_hdr;
+	pthread_mutex_init(&d.lock, NULL);
+
+	d.n_chunks = make_chunks(idx, bam_hdr, nworkers, &d.chunks);
+	if (d.n_chunks < 0) {
+		ret = -2;
+		goto err1;
+	}
+
+	workers = calloc(nworkers, sizeof(*workers));
+	if (workers == NULL) {
+		perror("calloc:workers");
+		ret = -3;
+		goto err2;
+	}
+
+	if (bam_ofp) {
+		if (owriter_start(&owr, opt, bam_ofp, bam_ohdr) < 0) {
+			ret = -3;
+			goto err3;
+		}
+		d.owr = &owr;
+	}
+
+	for (i=0; i<nworkers; i++) {
+		int r = worker_init(&workers[i], &d);
+		if (r == 0 && pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+			perror("pthread_create");
+			worker_destroy(&workers[i]);
+			r = -1;
+		}
+		if (r < 0) {
+			pthread_mutex_lock(&d.lock);
+			d.err = 1;
+			pthread_mutex_unlock(&d.lock);
+			if (d.owr)
+				owriter_abort(d.owr);
+			break;
+		}
+		n_started++;
+	}
+
+	for (i=0; i<n_started; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (!d.err)
+			damage_add(dmg, &workers[i].dmg, opt);
+		worker_destroy(&workers[i]);
+	}
+
+	if (d.owr && owriter_finish(d.owr) < 0)
+		d.err = 1;
+
+	ret = d.err ? -4 : 0;
+
+err3:
+	free(workers);
+err2:
+	chunks_free(d.chunks, d.n_chunks);
+err1:
+	pthread_mutex_destroy(&d.lock);
+	hts_idx_destroy(idx);
+	return ret;
+}
+
+/*
+ * Sequential reader.  If the bam is indexed, only the contigs with mapped
+ * reads are visited, so the unmapped reads that are typically found at the
+ * end of a sorted bam are never decompressed.
+ */
+typedef struct {
+	samFile *bam_fp;
+	bam_hdr_t *bam_hdr;
+	hts_idx_t *idx;
+	hts_itr_t *itr;
+	int tid;
+} reader_t;
+
+static void
+reader_init(reader_t *rd, const opt_t *opt, samFile *bam_fp, bam_hdr_t *bam_hdr)
+{
+	rd->bam_fp = bam_fp;
+	rd->bam_hdr = bam_hdr;
+	rd->idx = NULL;
+	rd->itr = NULL;
+	rd->tid = -1;
+
+	if (strcmp(opt->bam_fn, "-") != 0)
+		rd->idx = sam_index_load3(bam_fp, opt->bam_fn, NULL, HTS_IDX_SILENT_FAIL);
+}
+
+static void
+reader_destroy(reader_t *rd)
+{
+	if (rd->itr)
+		hts_itr_destroy(rd->itr);
+	if (rd->idx)
+		hts_idx_destroy(rd->idx);
+}
+
+/*
+ * Read the next record.  Returns >= 0 on success, -1 at the end of
+ * the file, or < -1 on error.
+ */
+static int
+reader_next(reader_t *rd, bam1_t *b)
+{
+	if (rd->idx == NULL)
+		return sam_read1(rd->bam_fp, rd->bam_hdr, b);
+
+	for (;;) {
+		if (rd->itr) {
+			int r = sam_itr_next(rd->bam_fp, rd->itr, b);
+			if (r != -1)
+				return r;
+			hts_itr_destroy(rd->itr);
+			rd->itr = NULL;
+		}
+
+		// find the next contig with mapped reads
+		while (++rd->tid < rd->bam_hdr->n_targets) {
+			uint64_t mapped, unmapped;
+			if (hts_idx_get_stat(rd->idx, rd->tid, &mapped, &unmapped) < 0
+					|| mapped > 0)
+				break;
+		}
+		if (rd->tid >= rd->bam_hdr->n_targets)
+			return -1;
+
+		rd->itr = sam_itr_queryi(rd->idx, rd->tid, 0, HTS_POS_MAX);
+		if (rd->itr == NULL)
+			return -2;
+	}
+}
+
+/*
+ * The sequential scan is a three stage pipeline.  A reader thread decodes
+ * records into batches, the calling thread scans them, and a writer thread
+ * (with -o) writes out the selected reads.  A fixed set of batches is
+ * passed between the stages through bounded queues, and recycled once
+ * written, so the bam1_t buffers are reused and memory use is bounded.
+ */
+#define PIPE_BATCH 4096 // records per batch
+#define PIPE_NBATCHES 4 // batches in flight
+
+typedef struct {
+	bam1_t *b[PIPE_BATCH];
+	char out[PIPE_BATCH]; // write the read to the output bam?
+	int n;
+} batch_t;
+
+/*
+ * Queue of batches.  A NULL batch marks the end of the input.
+ */
+typedef struct {
+	batch_t *q[PIPE_NBATCHES+1];
+	int head, n;
+	pthread_cond_t cond;
+} bqueue_t;
+
+typedef struct {
+	const opt_t *opt;
+	reader_t rd;
+	readahead_t *ra;
+	samFile *bam_ofp;
+	bam_hdr_t *bam_ohdr;
+
+	pthread_mutex_t lock;
+	bqueue_t free, full, done;
+	int err;
+
+	batch_t batches[PIPE_NBATCHES];
+} pipeline_t;
+
+static void
+bqueue_put(pipeline_t *p, bqueue_t *bq, batch_t *bt)
+{
+	pthread_mutex_lock(&p->lock);
+	bq->q[(bq->head + bq->n) % (PIPE_NBATCHES+1)] = bt;
+	bq->n++;
+	pthread_cond_signal(&bq->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Take the next batch from the queue, waiting for one if necessary.
+ * Returns NULL at the end of the input, or if the pipeline was aborted.
+ */
+static batch_t *
+bqueue_get(pipeline_t *p, bqueue_t *bq)
+{
+	batch_t *bt = NULL;
+
+	pthread_mutex_lock(&p->lock);
+	while (bq->n == 0 && !p->err)
+		pthread_cond_wait(&bq->cond, &p->lock);
+	if (!p->err) {
+		bt = bq->q[bq->head];
+		bq->head = (bq->head + 1) % (PIPE_NBATCHES+1);
+		bq->n--;
+	}
+	pthread_mutex_unlock(&p->lock);
+	return bt;
+}
+
+/*
+ * Stop all stages of the pipeline.
+ */
+static void
+pipeline_abort(pipeline_t *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->err = 1;
+	pthread_cond_broadcast(&p->free.cond);
+	pthread_cond_broadcast(&p->full.cond);
+	pthread_cond_broadcast(&p->done.cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static int
+pipeline_init(pipeline_t *p, const opt_t *opt, samFile *bam_fp, bam_hdr_t *bam_hdr,
+		samFile *bam_ofp, bam_hdr_t *bam_ohdr, readahead_t *ra)
+{
+	int i, j;
+
+	memset(p, 0, sizeof(*p));
+	p->opt = opt;
+	p->ra = ra;
+	p->bam_ofp = bam_ofp;
+	p->bam_ohdr = bam_ohdr;
+
+	for (i=0; i<PIPE_NBATCHES; i++) {
+		for (j=0; j<PIPE_BATCH; j++) {
+			p->batches[i].b[j] = bam_init1();
+			if (p->batches[i].b[j] == NULL)
+				goto err0;
+		}
+		p->free.q[i] = &p->batches[i];
+	}
+	p->free.n = PIPE_NBATCHES;
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->free.cond, NULL);
+	pthread_cond_init(&p->full.cond, NULL);
+	pthread_cond_init(&p->done.cond, NULL);
+
+	reader_init(&p->rd, opt, bam_fp, bam_hdr);
+
+	return 0;
+err0:
+	for (i=0; i<PIPE_NBATCHES; i++) {
+		for (j=0; j<PIPE_BATCH; j++) {
+			if (p->batches[i].b[j])
+				bam_destroy1(p->batches[i].b[j]);
+		}
+	}
+	return -1;
+}
+
+static void
+pipeline_destroy(pipeline_t *p)
+{
+	int i, j;
+
+	reader_destroy(&p->rd);
+	pthread_cond_destroy(&p->done.cond);
+	pthread_cond_destroy(&p->full.cond);
+	pthread_cond_destroy(&p->free.cond);
+	pthread_mutex_destroy(&p->lock);
+
+	for (i=0; i<PIPE_NBATCHES; i++) {
+		for (j=0; j<PIPE_BATCH; j++)
+			bam_destroy1(p->batches[i].b[j]);
+	}
+}
+
+/*
+ * Reader stage: fill free batches with records from the input.
+ */
+static void *
+pipeline_read(void *arg)
+{
+	pipeline_t *p = arg;
+	batch_t *bt;
+	int r = 0;
+
+	while (r != -1 && (bt = bqueue_get(p, &p->free)) != NULL) {
+		for (bt->n = 0; bt->n < PIPE_BATCH; bt->n++) {
+			r = reader_next(&p->rd, bt->b[bt->n]);
+			if (r < 0)
+				break;
+		}
+		if (r < -1) {
+			fprintf(stderr, "sam_read1: %s: read failed\n", p->opt->bam_fn);
+			pipeline_abort(p);
+			break;
+		}
+		if (p->ra)
+			// the readahead is only used for BGZF input
+			readahead_update(p->ra, bgzf_tell(p->rd.bam_fp->fp.bgzf) >> 16);
+		if (bt->n > 0)
+			bqueue_put(p, &p->full, bt);
+		else
+			bqueue_put(p, &p->free, bt);
+	}
+
+	if (r == -1)
+		bqueue_put(p, &p->full, NULL);
+	return NULL;
+}
+
+/*
+ * Writer stage: write out the selected reads, then recycle the batch.
+ */
+static void *
+pipeline_write(void *arg)
+{
+	pipeline_t *p = arg;
+	batch_t *bt;
+	int i;
+
+	while ((bt = bqueue_get(p, &p->done)) != NULL) {
+		for (i=0; i<bt->n; i++) {
+			if (!bt->out[i])
+				continue;
+			if (sam_write1(p->bam_ofp, p->bam_ohdr, bt->b[i]) < 0) {
+				fprintf(stderr, "sam_write1: %s: write failed\n", p->opt->bam_ofn);
+				pipeline_abort(p);
+				return NULL;
+			}
+		}
+		bqueue_put(p, &p->free, bt);
+	}
+
+	return NULL;
+}
+
+/*
+ * Scan the bam sequentially, from start to end.
+ */
+static int
+scan_file(const opt_t *opt, samFile *bam_fp, bam_hdr_t *bam_hdr,
+		samFile *bam_ofp, bam_hdr_t *bam_ohdr, damage_t *dmg, readahead_t *ra)
+{
+	pipeline_t *p;
+	pthread_t reader, writer;
+	refseq_t rs;
+	batch_t *bt;
+	int ret;
+
+	if (refseq_init(&rs, opt) < 0) {
+		ret = -1;
+		goto err0;
+	}
+
+	p = malloc(sizeof(*p));
+	if (p == NULL || pipeline_init(p, opt, bam_fp, bam_hdr, bam_ofp, bam_ohdr, ra) < 0) {
+		fprintf(stderr, "scan_file: failed to allocate memory: %s\n", strerror(errno));
+		ret = -2;
+		goto err1;
+	}
+
+	if (pthread_create(&reader, NULL, pipeline_read, p) != 0) {
+		fprintf(stderr, "pthread_create: failed to start reader\n");
+		ret = -3;
+		goto err2;
+	}
+
+	if (bam_ofp && pthread_create(&writer, NULL, pipeline_write, p) != 0) {
+		fprintf(stderr, "pthread_create: failed to start writer\n");
+		pipeline_abort(p);
+		pthread_join(reader, NULL);
+		ret = -3;
+		goto err2;
+	}
+
+	while ((bt = bqueue_get(p, &p->full)) != NULL) {
+		if (scan_batch(opt, dmg, &rs, bam_hdr, bt->b, bt->out, bt->n) < 0) {
+			pipeline_abort(p);
+			break;
+		}
+		bqueue_put(p, bam_ofp ? &p->done : &p->free, bt);
+	}
+
+	if (bam_ofp) {
+		bqueue_put(p, &p->done, NULL);
+		pthread_join(writer, NULL);
+	}
+	pthread_join(reader, NULL);
+
+	ret = p->err ? -4 : 0;
+err2:
+	pipeline_destroy(p);
+err1:
+	free(p);
+	refseq_destroy(&rs);
+err0:
+	return ret;
+}
+
+/*
+ * Open the output file.  The format is taken from -O if given,
+ * otherwise from the filename extension, defaulting to BAM.
+ */
+static samFile *
+open_output(const opt_t *opt)
+{
+	htsFormat fmt;
+	char mode[8] = "w";
+	samFile *fp;
+
+	memset(&fmt, 0, sizeof(fmt));
+	if (opt->bam_ofmt) {
+		if (hts_parse_format(&fmt, opt->bam_ofmt) < 0) {
+			fprintf(stderr, "-O `%s': unknown output format\n", opt->bam_ofmt);
+			return NULL;
+		}
+		switch (fmt.format) {
+			case sam:
+				break;
+			case bam:
+				strcat(mode, "b");
+				break;
+			case cram:
+				strcat(mode, "c");
+				break;
+			default:
+				fprintf(stderr, "-O `%s': output format must be sam, bam or cram\n", opt->bam_ofmt);
+				hts_opt_free(fmt.specific);
+				return NULL;
+		}
+	} else if (sam_open_mode(mode+1, opt->bam_ofn, NULL) < 0) {
+		// unknown extension
+		strcat(mode, "b");
+	}
+
+	if (opt->level >= 0 && (strchr(mode, 'b') || strchr(mode, 'c'))) {
+		size_t n = strlen(mode);
+		mode[n] = '0' + opt->level;
+		mode[n+1] = '\0';
+	}
+
+	fp = sam_open_format(opt->bam_ofn, mode, opt->bam_ofmt ? &fmt : NULL);
+	if (opt->bam_ofmt)
+		hts_opt_free(fmt.specific);
+	if (fp == NULL) {
+		fprintf(stderr, "bam_open: %s: %s\n", opt->bam_ofn, strerror(errno));
+		return NULL;
+	}
+
+	if (hts_get_format(fp)->format == cram && opt->fasta_fn
+			&& hts_set_fai_filename(fp, opt->fasta_fn) < 0) {
+		fprintf(stderr, "%s: failed to set CRAM reference `%s'\n",
+				opt->bam_ofn, opt->fasta_fn);
+		sam_close(fp);
+		return NULL;
+	}
+
+	return fp;
+}
+
+static void
+ref_close(opt_t *opt)
+{
+	refmap_close(opt->refmap);
+	opt->refmap = NULL;
+	refcache_destroy(opt->refcache);
+	opt->refcache = NULL;
+	refarena_destroy(opt->refarena);
+	opt->refarena = NULL;
+}
+
+/*
+ * Open the reference, which is shared by all threads, and by all the
+ * inputs scanned by this process.
+ */
+static int
+ref_open(opt_t *opt)
+{
+	if (opt->use_md)
+		return 0;
+
+	if (opt->shm_name) {
+		opt->refmap = refmap_open_shm(opt->shm_name, opt->fasta_fn);
+		if (opt->refmap == NULL)
+			return -1;
+	}
+
+	if (opt->refmap == NULL)
+		opt->refmap = refmap_open(opt->fasta_fn);
+	if (opt->refmap == NULL && !opt->sparse) {
+		opt->refcache = refcache_init(opt->refcache_size);
+		if (opt->refcache == NULL)
+			return -1;
+		refcache_prefetch_start(opt->refcache, opt->fasta_fn);
+	}
+
+	if (opt->preload) {
+		opt->refarena = refarena_load(opt, opt->preload);
+		if (opt->refarena == NULL) {
+			ref_close(opt);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Scan opt->bam_fn, adding its damage patterns to dmg.
+ * The reference must already be open, see ref_open().
+ */
+static int
+scan_input(opt_t *opt, damage_t *dmg)
+{
+	int i;
+	int ret;
+
+	samFile *bam_fp, *bam_ofp = NULL;
+	bam_hdr_t *bam_hdr, *bam_ohdr = NULL;
+	htsThreadPool tpool = {NULL, 0};
+	readahead_t *ra = NULL;
+	hts_idx_t *idx = NULL;
+
+	if (opt->nthreads > 0) {
+		tpool.pool = hts_tpool_init(opt->nthreads);
+		if (tpool.pool == NULL) {
+			fprintf(stderr, "hts_tpool_init: failed to create %d threads\n", opt->nthreads);
+			ret = -2;
+			goto err0;
+		}
+	}
+
+	bam_fp = open_input(opt);
+	if (bam_fp == NULL) {
+		ret = -3;
+		goto err1;
+	}
+
+	if (tpool.pool && hts_set_thread_pool(bam_fp, &tpool) < 0) {
+		fprintf(stderr, "%s: failed to attach thread pool\n", opt->bam_fn);
+		ret = -3;
+		goto err2;
+	}
+
+	bam_hdr = sam_hdr_read(bam_fp);
+	if (bam_hdr == NULL) {
+		fprintf(stderr, "%s: couldn't read header\n", opt->bam_fn);
+		ret = -4;
+		goto err2;
+	}
+
+	if (opt->bam_ofn) {
+		bam_ofp = open_output(opt);
+		if (bam_ofp == NULL) {
+			ret = -5;
+			goto err3;
+		}
+
+		if (tpool.pool && hts_set_thread_pool(bam_ofp, &tpool) < 0) {
+			fprintf(stderr, "%s: failed to attach thread pool\n", opt->bam_ofn);
+			ret = -5;
+			goto err4;
+		}
+
+		bam_ohdr = bam_hdr_dup(bam_hdr);
+		if (bam_ohdr == NULL) {
+			/*
+			 * XXX: bam_hdr_dup doesn't properly check for
+			 * allocation failures, so we'll crash before
+			 * getting here.
+			 */
+			fprintf(stderr, "bam_hdr_dup: failed to allocate memory: %s\n", strerror(errno));
+			ret = -6;
+			goto err4;
+		}
+
+#define BUFLEN 8096
+		char pgbuf[BUFLEN];
+		int offs = snprintf(pgbuf, BUFLEN, "@PG\tID:condamage\tPN:condamage\tVN:%s\tCL:", CONDAMAGE_VERSION);
+		for (i=0; i<opt->argc && offs < BUFLEN-1; i++)
+			offs += snprintf(pgbuf+offs, BUFLEN-offs, "%s%s", i==0?"":" ", opt->argv[i]);
+
+		if (bam_hdr_append(bam_ohdr, pgbuf) < 0) {
+			ret = -7;
+			goto err5;
+		}
+
+		if (sam_hdr_write(bam_ofp, bam_ohdr) < 0) {
+			fprintf(stderr, "sam_hdr_write: %s: %s\n", opt->bam_ofn, strerror(errno));
+			ret = -8;
+			goto err5;
+		}
+	}
+
+	if (opt->shm_name && opt->refmap
+			&& refmap_check_hdr(opt->refmap, bam_hdr, opt->shm_name) < 0) {
+		ret = -9;
+		goto err5;
+	}
+
+	if (!opt->use_md && opt->refarena) {
+		opt->refarena_idx = refarena_idx_init(opt->refarena, bam_hdr);
+		if (opt->refarena_idx == NULL) {
+			ret = -9;
+			goto err5;
+		}
+	}
+
+	// an indexed bam is scanned by region with -p, which has no use
+	// for the readahead, as the workers each seek around the file
+	if (opt->parallel && strcmp(opt->bam_fn, "-") != 0)
+		idx = sam_index_load3(bam_fp, opt->bam_fn, NULL, HTS_IDX_SILENT_FAIL);
+
+	if (opt->readahead) {
+		const htsFormat *fmt = hts_get_format(bam_fp);
+		if (idx)
+			fprintf(stderr, "%s: readahead isn't used for an indexed bam with -p, ignoring -B\n",
+					opt->bam_fn);
+		else if (fmt->compression == bgzf && strcmp(opt->bam_fn, "-") != 0)
+			ra = readahead_start(opt->bam_fn, opt->readahead);
+		if (ra == NULL && idx == NULL)
+			fprintf(stderr, "%s: readahead not possible, ignoring -B\n", opt->bam_fn);
+	}
+
+	if (opt->parallel)
+		ret = scan_parallel(opt, bam_fp, bam_hdr, bam_ofp, bam_ohdr, dmg, idx, ra);
+	else
+		ret = scan_file(opt, bam_fp, bam_hdr, bam_ofp, bam_ohdr, dmg, ra);
+	readahead_stop(ra);
+	refarena_idx_destroy(opt->refarena_idx);
+	opt->refarena_idx = NULL;
+	if (ret < 0) {
+		ret = -9;
+		goto err5;
+	}
+
+	ret = 0;
+err5:
+	if (bam_ohdr)
+		bam_hdr_destroy(bam_ohdr);
+err4:
+	if (bam_ofp)
+		sam_close(bam_ofp);
+err3:
+	bam_hdr_destroy(bam_hdr);
+err2:
+	sam_close(bam_fp);
+err1:
+	if (tpool.pool)
+		hts_tpool_destroy(tpool.pool);
+err0:
+	return ret;
+}
+
+/*
+ * Scan opt->bam_fn, and write the damage patterns to out_fp.
+ * The reference must already be open, see ref_open().
+ */
+int
+condamage(opt_t *opt, FILE *out_fp)
+{
+	damage_t dmg;
+	int ret;
+
+	if (damage_init(&dmg, opt) < 0)
+		return -1;
+
+	ret = scan_input(opt, &dmg);
+	if (ret == 0 && damage_print(opt, &dmg, out_fp) < 0)
+		ret = -10;
+
+	damage_free(&dmg);
+	return ret;
+}
+
+/*
+ * `condamage index': write the packed reference, ref.fasta.c2b.
+ */
+static int
+put_u32(FILE *fp, uint32_t x)
+{
+	uint8_t buf[4];
+	u32_to_le(x, buf);
+	return fwrite(buf, 4, 1, fp) == 1 ? 0 : -1;
+}
+
+static int
+put_u64(FILE *fp, uint64_t x)
+{
+	uint8_t buf[8];
+	u64_to_le(x, buf);
+	return fwrite(buf, 8, 1, fp) == 1 ? 0 : -1;
+}
+
+/*
+ * Pack one contig, appending its sequence and N runs to fp at offset *off,
+ * and fill in the offsets in its contig table entry c.
+ */
+static int
+c2b_write_ctg(FILE *fp, faidx_t *fai, refmap_ctg_t *c, int64_t *off)
+{
+	uint8_t *packed;
+	uint64_t *runs = NULL;
+	int64_t n_runs = 0, m_runs = 0;
+	char *seq = NULL;
+	int len = 0;
+	int64_t x, l_packed = (c->len+3)/4;
+	int ret = -1;
+
+	if (c->len > 0) {
+		seq = faidx_fetch_seq(fai, c->name, 0, c->len-1, &len);
+		if (seq == NULL || len != c->len) {
+			fprintf(stderr, "%s: failed to fetch sequence\n", c->name);
+			goto err0;
+		}
+	}
+
+	packed = calloc(l_packed ? l_packed : 1, 1);
+	if (packed == NULL)
+		goto err1;
+
+	for (x=0; x<c->len; x++) {
+		int code;
+		switch (seq_nt16_table[(uint8_t)seq[x]]) {
+			case 1: code = 0; break;
+			case 2: code = 1; break;
+			case 4: code = 2; break;
+			case 8: code = 3; break;
+			default: code = -1; break;
+		}
+
+		if (code >= 0) {
+			packed[x>>2] |= code << (6 - 2*(x&3));
+		} else if (n_runs > 0 && runs[2*n_runs-2] + runs[2*n_runs-1] == (uint64_t)x) {
+			// extend the current N run
+			runs[2*n_runs-1]++;
+		} else {
+			if (n_runs == m_runs) {
+				m_runs = m_runs ? m_runs*2 : 64;
+				uint64_t *tmp = realloc(runs, 2*m_runs * sizeof(*tmp));
+				if (tmp == NULL)
+					goto err2;
+				runs = tmp;
+			}
+			runs[2*n_runs] = x;
+			runs[2*n_runs+1] = 1;
+			n_runs++;
+		}
+	}
+
+	c->offset = *off;
+	if (fwrite(packed, 1, l_packed, fp) != (size_t)l_packed)
+		goto err2;
+	*off += l_packed;
+
+	c->runs_offset = *off;
+	c->n_runs = n_runs;
+	for (x=0; x<2*n_runs; x++) {
+		if (put_u64(fp, runs[x]) < 0)
+			goto err2;
+	}
+	*off += 16*n_runs;
+
+	ret = 0;
+err2:
+	free(runs);
+	free(packed);
+err1:
+	free(seq);
+err0:
+	return ret;
+}
+
+/*
+ * Write the packed reference for fai to fp, which must be seekable.
+ * The header's magic is written last, so a reader that sees it knows
+ * the rest is complete.
+ */
+static int
+c2b_write_fp(FILE *fp, faidx_t *fai)
+{
+	refmap_ctg_t *ctg;
+	int i, n_ctg;
+	int64_t off = C2B_HDR_LEN;
+	int ret = -1;
+
+	n_ctg = faidx_nseq(fai);
+	ctg = calloc(n_ctg ? n_ctg : 1, sizeof(*ctg));
+	if (ctg == NULL)
+		goto err0;
+
+	// header, filled in at the end
+	if (fwrite("\0\0\0\0\0\0\0\0", 8, 1, fp) != 1 || put_u32(fp, 0) < 0
+			|| put_u32(fp, 0) < 0 || put_u64(fp, 0) < 0)
+		goto err1;
+
+	for (i=0; i<n_ctg; i++) {
+		ctg[i].name = (char *)faidx_iseq(fai, i);
+		ctg[i].len = faidx_seq_len(fai, ctg[i].name);
+		if (ctg[i].len < 0 || c2b_write_ctg(fp, fai, &ctg[i], &off) < 0)
+			goto err1;
+	}
+
+	for (i=0; i<n_ctg; i++) {
+		uint32_t l_name = strlen(ctg[i].name) + 1;
+		if (put_u64(fp, ctg[i].len) < 0 || put_u64(fp, ctg[i].offset) < 0
+				|| put_u64(fp, ctg[i].runs_offset) < 0
+				|| put_u64(fp, ctg[i].n_runs) < 0
+				|| put_u32(fp, l_name) < 0
+				|| fwrite(ctg[i].name, l_name, 1, fp) != 1)
+			goto err1;
+	}
+
+	if (fflush(fp) != 0 || fseek(fp, 0, SEEK_SET) < 0
+			|| fwrite(C2B_MAGIC, 8, 1, fp) != 1 || put_u32(fp, C2B_VERSION) < 0
+			|| put_u32(fp, n_ctg) < 0 || put_u64(fp, off) < 0)
+		goto err1;
+
+	ret = 0;
+err1:
+	free(ctg);
+err0:
+	return ret;
+}
+
+/*
+ * Write ref.fasta.c2b.  The file is written under a temporary name,
+ * and renamed once complete, so readers never see a partial file.
+ */
+static int
+c2b_write(const char *fasta_fn)
+{
+	faidx_t *fai;
+	char fn[4096], tmp_fn[4096];
+	FILE *fp;
+	int ret;
+
+	fai = fai_load(fasta_fn);
+	if (fai == NULL) {
+		fprintf(stderr, "%s: couldn't load fasta index\n", fasta_fn);
+		ret = -1;
+		goto err0;
+	}
+
+	snprintf(fn, sizeof(fn), "%s.c2b", fasta_fn);
+	snprintf(tmp_fn, sizeof(tmp_fn), "%s.c2b.tmp", fasta_fn);
+	fp = fopen(tmp_fn, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "%s: %s\n", tmp_fn, strerror(errno));
+		ret = -3;
+		goto err1;
+	}
+
+	if (c2b_write_fp(fp, fai) < 0) {
+		ret = -4;
+		goto err2;
+	}
+
+	if (fclose(fp) != 0) {
+		fp = NULL;
+		ret = -4;
+		goto err2;
+	}
+	fp = NULL;
+
+	if (rename(tmp_fn, fn) < 0) {
+		fprintf(stderr, "rename: %s: %s\n", fn, strerror(errno));
+		ret = -5;
+		goto err2;
+	}
+
+	ret = 0;
+err2:
+	if (ret < 0) {
+		if (ret == -4)
+			fprintf(stderr, "%s: write failed\n", tmp_fn);
+		if (fp)
+			fclose(fp);
+		unlink(tmp_fn);
+	}
+err1:
+	fai_destroy(fai);
+err0:
+	return ret;
+}
+
+static void
+usage(const opt_t *opt)
+{
+	fprintf(stderr, "condamage v%s\n", CONDAMAGE_VERSION);
+	fprintf(stderr, "usage: %s [...] in.bam|@FILE ... ref.fasta\n", opt->argv[0]);
+	fprintf(stderr, "       %s -m [...] in.bam|@FILE ... [ref.fasta]\n", opt->argv[0]);
+	fprintf(stderr, "       %s index ref.fasta\n", opt->argv[0]);
+	fprintf(stderr, "       %s serve [...] SOCKET ref.fasta\n", opt->argv[0]);
+	fprintf(stderr, "       %s submit SOCKET [...] in.bam out.txt\n", opt->argv[0]);
+	fprintf(stderr, "       %s batch [...] ref.fasta in.bam|@FILE ...\n", opt->argv[0]);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  in.bam may be SAM, BAM or CRAM.  CRAM is decoded using ref.fasta.\n");
+	fprintf(stderr, "  Several in.bam, e.g. one per lane or library of a sample, are scanned\n");
+	fprintf(stderr, "  -j at a time, and summed into one set of tables.  With -m, the last\n");
+	fprintf(stderr, "  argument is taken as ref.fasta only if it is a fasta file.\n");
+	fprintf(stderr, "  `index' writes ref.fasta.c2b, a packed copy of the reference that is\n");
+	fprintf(stderr, "  used instead of ref.fasta whenever it exists and is up to date.\n");
+	fprintf(stderr, "  `serve' keeps ref.fasta open, and runs the jobs sent to the Unix socket\n");
+	fprintf(stderr, "  SOCKET with `submit', -j at a time.  Options given to `serve' are the\n");
+	fprintf(stderr, "  defaults for its jobs, but jobs can't change -c, -R, -s or -M.\n");
+	fprintf(stderr, "  `batch' scans each in.bam, -j at a time, writing in.bam.condamage.txt.\n");
+	fprintf(stderr, "  @FILE reads a manifest, with one in.bam per line, optionally followed\n");
+	fprintf(stderr, "  by a tab and the output filename.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -m           Obtain reference bases from the MD tags, rather than ref.fasta\n");
+	fprintf(stderr, "  -w INT       Size of the region for which (mis)matches are recorded [%zd]\n", opt->window);
+	fprintf(stderr, "  -o FILE      BAM output filename [%s]\n", opt->bam_ofn?opt->bam_ofn:"");
+	fprintf(stderr, "  -O FMT       Output format for -o: sam, bam or cram, optionally followed\n");
+	fprintf(stderr, "                by ,OPT=VAL format options [from -o extension, else bam]\n");
+	fprintf(stderr, "  -L INT       Compression level for BAM/CRAM output, 0-9 [htslib default]\n");
+	fprintf(stderr, "  -@ INT       Number of additional threads for BAM (de)compression [%d]\n", opt->nthreads);
+	fprintf(stderr, "  -p           Scan in parallel, using -@ threads.  Regions of the genome\n");
+	fprintf(stderr, "                are scanned in parallel for a sorted and indexed BAM,\n");
+	fprintf(stderr, "                otherwise the BAM's compressed blocks are decoded in parallel.\n");
+	fprintf(stderr, "  -B INT       Read up to INT MB of a BGZF compressed input ahead of the\n");
+	fprintf(stderr, "                scan, to hide filesystem latency; 0 disables [%zd]\n", opt->readahead>>20);
+	fprintf(stderr, "  -c INT       Cache up to INT MB of decoded contigs, if ref.fasta is\n");
+	fprintf(stderr, "                bgzipped, for input that isn't sorted by position [%zd]\n", opt->refcache_size>>20);
+	fprintf(stderr, "  -s INT       Preload all contigs of up to INT bp before the scan, for\n");
+	fprintf(stderr, "                assemblies with many small scaffolds; 0 disables [%zd]\n", opt->preload);
+	fprintf(stderr, "  -R           Fetch only the reference under each read, in %d kb blocks,\n", REFBLK_LEN>>10);
+	fprintf(stderr, "                rather than whole contigs, if ref.fasta is bgzipped.\n");
+	fprintf(stderr, "                For low coverage samples.\n");
+	fprintf(stderr, "  -M NAME      Share the packed reference between concurrent jobs, in POSIX\n");
+	fprintf(stderr, "                shared memory segment NAME (e.g. /hg38).  The first job\n");
+	fprintf(stderr, "                publishes it from ref.fasta.  On Linux, remove it with\n");
+	fprintf(stderr, "                rm /dev/shm/NAME\n");
+	fprintf(stderr, "  -j INT       Number of inputs to scan at once [all of them, up to -@,\n");
+	fprintf(stderr, "                or else the number of CPUs]\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -C INT,INT   Output reads with a C->T mismatch within INT bases of terminal\n");
+	fprintf(stderr, "                position (5',3') [%d,%d]\n", opt->c5, opt->c3);
+	fprintf(stderr, "                E.g. -C 3,3 outputs reads with C->T mismatches in any of the 3 \n");
+	fprintf(stderr, "                positions at the start or end of a read.\n");
+	fprintf(stderr, "                -C 1,1 is appropriate for single stranded libaries.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -G INT,INT   Output reads with a G->A mismatch within INT bases of terminal\n");
+	fprintf(stderr, "                position (5',3') [%d,%d]\n", opt->g5, opt->g3);
+	fprintf(stderr, "                E.g. -C 3,0 -G 0,3 outputs reads with C->T mismatches in any of\n");
+	fprintf(stderr, "                the 3 positions at the start of the read, or a G->A mismatch in\n");
+	fprintf(stderr, "                any of the 3 positions at the end of the read.\n");
+	fprintf(stderr, "                -C 1,0 -G 0,1 is appropriate for double stranded libaries.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -l INT       Maximum length for fragment length histograms [%d]\n", opt->lmax);
+
+	//fprintf(stderr, "  -f           Only consider reads aligned to the forward (ref) strand\n");
+	//fprintf(stderr, "  -r           Only consider reads aligned to the reverse (non ref) strand\n");
+	exit(1);
+}
+
+static void
+opt_init(opt_t *opt, int argc, char **argv)
+{
+	memset(opt, 0, sizeof(opt_t));
+	opt->window = 30;
+	opt->lmax = 1024;
+	opt->level = -1;
+	opt->refcache_size = (size_t)1024 << 20;
+	opt->argc = argc;
+	opt->argv = argv;
+}
+
+static pthread_mutex_t parse_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Parse the options in argv into opt, which should hold the defaults.
+ * Returns the index of the first argument after the options, or -1 if
+ * the options are invalid.  getopt() isn't reentrant, so threads must
+ * hold parse_lock.
+ */
+static int
+parse_args(opt_t *opt, int argc, char **argv)
+{
+	int c;
+
+#ifdef __GLIBC__
+	optind = 0; // also discard any state left by a failed parse
+#else
+	optind = 1;
+#endif
+	while ((c = getopt(argc, argv, "w:o:O:L:C:G:fr@:pmB:c:s:RM:j:")) != -1) {
+		switch (c) {
+			case 'w':
+				{
+					unsigned long w = strtoul(optarg, NULL, 0);
+					if (w < 0 || w > 100) {
+						fprintf(stderr, "-w `%s' is invalid\n", optarg);
+						return -1;
+					}
+					opt->window = w;
+				}
+				break;
+			case 'o':
+				opt->bam_ofn = optarg;
+				break;
+			case 'O':
+				opt->bam_ofmt = optarg;
+				break;
+			case 'L':
+				{
+					char *tmp;
+					long l = strtol(optarg, &tmp, 0);
+					if (l < 0 || l > 9 || *tmp != '\0') {
+						fprintf(stderr, "-L `%s' is invalid\n", optarg);
+						return -1;
+					}
+					opt->level = l;
+				}
+				break;
+			case 'l':
+				{
+					unsigned long l = strtoul(optarg, NULL, 0);
+					if (l < 100 || l > 1024*1024) {
+						fprintf(stderr, "-l `%s' is invalid\n", optarg);
+						return -1;
+					}
+					opt->lmax = l;
+				}
+				break;
+			case '@':
+				{
+					long t = strtol(optarg, NULL, 0);
+					if (t < 0 || t > 1024) {
+						fprintf(stderr, "-@ `%s' is invalid\n", optarg);
+						return -1;
+					}
+					opt->nthreads = t;
+				}
+				break;
+			case 'p':
+				opt->parallel = 1;
+				break;
+			case 'B':
+				{
+					char *tmp;
+					long mb = strtol(optarg, &tmp, 0);
+					if (mb < 0 || mb > 64*1024 || *tmp != '\0') {
+						fprintf(stderr, "-B `%s' is invalid\n", optarg);
+						return -1;
+					}
+					opt->readahead = (size_t)mb << 20;
+				}
+				break;
+			case 'c':
+				{
+					char *tmp;
+					long mb = strtol(optarg, &tmp, 0);
+					if (mb < 0 || mb > 1024*1024 || *tmp != '\0') {
+						fprintf(stderr, "-c `%s' is invalid\n", optarg);
+						return -1;
+					}
+					opt->refcache_size = (size_t)mb << 20;
+				}
+				break;
+			case 's':
+				{
+					char *tmp;
+					long l = strtol(optarg, &tmp, 0);
+					if (l < 0 || l > INT_MAX || *tmp != '\0') {
+						fprintf(stderr, "-s `%s' is invalid\n", optarg);
+						return -1;
+					}
+					opt->preload = l;
+				}
+				break;
+			case 'm':
+				opt->use_md = 1;
+				break;
+			case 'R':
+				opt->sparse = 1;
+				break;
+			case 'M':
+				opt->shm_name = optarg;
+				break;
+			case 'j':
+				{
+					long j = strtol(optarg, NULL, 0);
+					if (j < 1 || j > 1024) {
+						fprintf(stderr, "-j `%s' is invalid\n", optarg);
+						return -1;
+					}
+					opt->njobs = j;
+				}
+				break;
+			case 'f':
+				opt->fwd_only = 1;
+				break;
+			case 'r':
+				opt->rev_only = 1;
+				break;
+			case 'C':
+				{
+					char *tmp;
+					unsigned long x1, x2;
+					x1 = strtoul(optarg, &tmp, 0);
+					if (x1 < 0 || x1 > 100 || tmp[0] != ',') {
+						fprintf(stderr, "-C `%s' is invalid\n", optarg);
+						return -1;
+					}
+
+					x2 = strtoul(tmp+1, NULL, 0);
+					if (x2 < 0 || x2 > 100) {
+						fprintf(stderr, "-C `%s' is invalid\n", optarg);
+						return -1;
+					}
+
+					opt->c5 = x1;
+					opt->c3 = x2;
+				}
+				break;
+			case 'G':
+				{
+					char *tmp;
+					unsigned long x1, x2;
+					x1 = strtoul(optarg, &tmp, 0);
+					if (x1 < 0 || x1 > 100 || tmp[0] != ',') {
+						fprintf(stderr, "-G `%s' is invalid\n", optarg);
+						return -1;
+					}
+
+					x2 = strtoul(tmp+1, NULL, 0);
+					if (x2 < 0 || x2 > 100) {
+						fprintf(stderr, "-G `%s' is invalid\n", optarg);
+						return -1;
+					}
+
+					opt->g5 = x1;
+					opt->g3 = x2;
+				}
+				break;
+			default:
+				return -1;
+		}
+	}
+
+	int cgsum = opt->c5+opt->c3+opt->g5+opt->g3;
+	if (cgsum && opt->bam_ofn == NULL) {
+		fprintf(stderr, "-C/-G specified, but no -o FILE given\n");
+		return -1;
+	}
+	if (opt->bam_ofn && cgsum == 0) {
+		fprintf(stderr, "-o FILE specified, but no -C/-G\n");
+		return -1;
+	}
+	if ((opt->bam_ofmt || opt->level >= 0) && opt->bam_ofn == NULL) {
+		fprintf(stderr, "-O/-L specified, but no -o FILE given\n");
+		return -1;
+	}
+
+	if (opt->fwd_only && opt->rev_only) {
+		fprintf(stderr, "-f and -r flags are mutually incompatible\n");
+		return -1;
+	}
+
+	return optind;
+}
+
+/*
+ * The number of jobs to run at once, out of n.  This is -j if given,
+ * otherwise all n, up to -@ or the number of online CPUs.
+ */
+static int
+get_njobs(const opt_t *opt, int n)
+{
+	long max = opt->njobs;
+
+	if (max == 0)
+		max = opt->nthreads > 0 ? opt->nthreads : sysconf(_SC_NPROCESSORS_ONLN);
+	if (max < 1)
+		max = 1;
+	return n < max ? n : max;
+}
+
+/*
+ * Scan opt->bam_fn, and write the damage patterns to out_fn, which is
+ * removed if the scan fails.
+ */
+static int
+run_job(opt_t *opt, const char *out_fn)
+{
+	FILE *out_fp;
+	int ret;
+
+	out_fp = fopen(out_fn, "w");
+	if (out_fp == NULL) {
+		fprintf(stderr, "%s: %s\n", out_fn, strerror(errno));
+		return -1;
+	}
+	ret = condamage(opt, out_fp);
+	if (fclose(out_fp) != 0 && ret == 0) {
+		fprintf(stderr, "%s: write failed\n", out_fn);
+		ret = -1;
+	}
+	// don't leave partial results
+	if (ret < 0)
+		unlink(out_fn);
+	return ret;
+}
+
+/*
+ * `condamage serve' keeps the reference open, and runs jobs sent by
+ * `condamage submit' over a Unix socket, opt->njobs at a time.  A request
+ * is the client's working directory followed by the job's arguments, each
+ * terminated by a NUL, then EOF.  The reply is the job's exit status, as
+ * a line of text.  Messages from jobs go to the server's stderr.
+ */
+#define SERVE_QLEN 64
+#define SERVE_MAX_REQ (64*1024)
+
+typedef struct {
+	opt_t *opt; // server options, and the open reference
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int fds[SERVE_QLEN]; // accepted connections, waiting for a worker
+	int head, n;
+	int stop;
+} server_t;
+
+static volatile sig_atomic_t serve_stop;
+
+static void
+serve_sig(int sig)
+{
+	serve_stop = 1;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Read from fd until EOF.  Returns the length, or -1 on error.
+ */
+static ssize_t
+read_all(int fd, char *buf, size_t len)
+{
+	size_t off = 0;
+
+	while (off < len) {
+		ssize_t n = read(fd, buf+off, len-off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			return off;
+		off += n;
+	}
+	return -1; // too long
+}
+
+/*
+ * Paths in a job are relative to the client's working directory.
+ */
+static char *
+job_path(const char *cwd, const char *fn)
+{
+	char *path;
+
+	if (fn[0] == '/')
+		return strdup(fn);
+	path = malloc(strlen(cwd) + strlen(fn) + 2);
+	if (path)
+		sprintf(path, "%s/%s", cwd, fn);
+	return path;
+}
+
+/*
+ * Run the job requested on connection fd.  Returns 0 on success.
+ */
+static int
+serve_job(server_t *srv, int fd)
+{
+	char *buf, *bam_fn = NULL, *out_fn = NULL, *bam_ofn = NULL;
+	char **argv = NULL;
+	ssize_t len;
+	int i, argc, ret = -1;
+	opt_t opt;
+
+	buf = malloc(SERVE_MAX_REQ);
+	if (buf == NULL)
+		goto err0;
+	len = read_all(fd, buf, SERVE_MAX_REQ);
+	if (len <= 0 || buf[len-1] != '\0') {
+		fprintf(stderr, "serve: invalid request\n");
+		goto err1;
+	}
+
+	// the first string is the cwd, which is replaced by argv[0]
+	for (argc=0, i=0; i<len; i++)
+		argc += buf[i] == '\0';
+	argv = malloc((argc+1) * sizeof(*argv));
+	if (argv == NULL)
+		goto err1;
+	argv[0] = "condamage";
+	for (argc=0, i=0; i<len; i += strlen(buf+i)+1, argc++) {
+		if (argc > 0)
+			argv[argc] = buf+i;
+	}
+	argv[argc] = NULL;
+
+	// the server's options are the defaults
+	opt = *srv->opt;
+	opt.argc = argc;
+	opt.argv = argv;
+	pthread_mutex_lock(&parse_lock);
+	i = parse_args(&opt, argc, argv);
+	pthread_mutex_unlock(&parse_lock);
+	if (i < 0 || argc-i != 2) {
+		fprintf(stderr, "serve: invalid job, expected [options] in.bam out.txt\n");
+		goto err2;
+	}
+
+	// the reference options are the server's
+	opt.fasta_fn = srv->opt->fasta_fn;
+	opt.refmap = srv->opt->refmap;
+	opt.refcache = srv->opt->refcache;
+	opt.refcache_size = srv->opt->refcache_size;
+	opt.refarena = srv->opt->refarena;
+	opt.preload = srv->opt->preload;
+	opt.sparse = srv->opt->sparse;
+	opt.shm_name = srv->opt->shm_name;
+
+	if (strcmp(argv[i], "-") == 0) {
+		fprintf(stderr, "serve: jobs can't read from stdin\n");
+		goto err2;
+	}
+	bam_fn = job_path(buf, argv[i]);
+	out_fn = job_path(buf, argv[i+1]);
+	if (opt.bam_ofn)
+		bam_ofn = job_path(buf, opt.bam_ofn);
+	if (bam_fn == NULL || out_fn == NULL || (opt.bam_ofn && bam_ofn == NULL)) {
+		fprintf(stderr, "serve: failed to allocate memory\n");
+		goto err3;
+	}
+	opt.bam_fn = bam_fn;
+	opt.bam_ofn = bam_ofn;
+	ret = run_job(&opt, out_fn);
+
+err3:
+	free(bam_ofn);
+	free(out_fn);
+	free(bam_fn);
+err2:
+	free(argv);
+err1:
+	free(buf);
+err0:
+	return ret;
+}
+
+static void *
+serve_worker(void *arg)
+{
+	server_t *srv = arg;
+	char reply[16];
+	int fd, ret;
+
+	for (;;) {
+		pthread_mutex_lock(&srv->lock);
+		while (srv->n == 0 && !srv->stop)
+			pthread_cond_wait(&srv->cond, &srv->lock);
+		if (srv->n == 0) {
+			pthread_mutex_unlock(&srv->lock);
+			break;
+		}
+		fd = srv->fds[srv->head];
+		srv->head = (srv->head + 1) % SERVE_QLEN;
+		srv->n--;
+		pthread_cond_broadcast(&srv->cond);
+		pthread_mutex_unlock(&srv->lock);
+
+		ret = serve_job(srv, fd);
+		snprintf(reply, sizeof(reply), "%d\n", ret < 0 ? 1 : 0);
+		write_all(fd, reply, strlen(reply));
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/*
+ * If the socket at addr was left behind by a server that has exited,
+ * remove it.  Returns -1 if another server is listening there.
+ */
+static int
+serve_clean_socket(const struct sockaddr_un *addr)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	int ret = -1;
+
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0
+			&& errno == ECONNREFUSED) {
+		unlink(addr->sun_path);
+		ret = 0;
+	}
+	close(fd);
+	return ret;
+}
+
+static int
+serve(opt_t *opt, const char *sock_fn)
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	sigset_t set, oset;
+	server_t srv;
+	pthread_t *threads;
+	int fd, i, n_threads = 0, ret = -1;
+
+	if (strlen(sock_fn) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path is too long\n", sock_fn);
+		goto err0;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sock_fn);
+	opt->njobs = get_njobs(opt, INT_MAX);
+
+	// load the reference before accepting jobs
+	if (ref_open(opt) < 0)
+		goto err0;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		fprintf(stderr, "socket: %s\n", strerror(errno));
+		goto err1;
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+			&& (errno != EADDRINUSE || serve_clean_socket(&addr) < 0
+				|| bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)) {
+		fprintf(stderr, "%s: %s\n", sock_fn,
+				errno == EADDRINUSE ? "already in use by another server" : strerror(errno));
+		goto err2;
+	}
+	if (listen(fd, SERVE_QLEN) < 0) {
+		fprintf(stderr, "listen: %s: %s\n", sock_fn, strerror(errno));
+		goto err3;
+	}
+	// accept() is only called once pselect() says a connection is
+	// waiting, but it may have gone again by then
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+		fprintf(stderr, "fcntl: %s: %s\n", sock_fn, strerror(errno));
+		goto err3;
+	}
+
+	// stop accepting jobs on SIGINT or SIGTERM, and finish those queued
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = serve_sig;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&srv, 0, sizeof(srv));
+	srv.opt = opt;
+	pthread_mutex_init(&srv.lock, NULL);
+	pthread_cond_init(&srv.cond, NULL);
+
+	threads = malloc(opt->njobs * sizeof(*threads));
+	if (threads == NULL) {
+		fprintf(stderr, "serve: failed to allocate memory\n");
+		goto err4;
+	}
+
+	// SIGINT and SIGTERM stay blocked, except while this thread waits in
+	// pselect(), so a signal arriving after serve_stop is checked still
+	// wakes it.  The workers inherit the blocked mask.
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	for (n_threads=0; n_threads<opt->njobs; n_threads++) {
+		if (pthread_create(&threads[n_threads], NULL, serve_worker, &srv) != 0) {
+			fprintf(stderr, "pthread_create: failed to create thread\n");
+			break;
+		}
+	}
+	if (n_threads < opt->njobs)
+		goto err5;
+
+	fprintf(stderr, "%s: serving %s, %d jobs at a time\n", sock_fn, opt->fasta_fn, opt->njobs);
+	while (!serve_stop) {
+		fd_set rfds;
+		int cfd;
+
+		FD_ZERO(&rfds);
+		FD_SET(fd, &rfds);
+		if (pselect(fd+1, &rfds, NULL, NULL, NULL, &oset) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "pselect: %s: %s\n", sock_fn, strerror(errno));
+			goto err5;
+		}
+		cfd = accept(fd, NULL, NULL);
+		if (cfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED
+					|| errno == EAGAIN || errno == EWOULDBLOCK)
+				continue;
+			fprintf(stderr, "accept: %s: %s\n", sock_fn, strerror(errno));
+			goto err5;
+		}
+		// some systems pass O_NONBLOCK on to the accepted socket
+		fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) & ~O_NONBLOCK);
+
+		pthread_mutex_lock(&srv.lock);
+		while (srv.n == SERVE_QLEN)
+			pthread_cond_wait(&srv.cond, &srv.lock);
+		srv.fds[(srv.head + srv.n) % SERVE_QLEN] = cfd;
+		srv.n++;
+		pthread_cond_broadcast(&srv.cond);
+		pthread_mutex_unlock(&srv.lock);
+	}
 
 	ret = 0;
-err10:
-	if (bam_ohdr)
-		bam_hdr_destroy(bam_ohdr);
-err9:
-	if (bam_ofp)
-		sam_close(bam_ofp);
-err8:
-	bam_destroy1(b);
-//
-	if (ref)
-		free(ref);
-err7:
-	if (opt->fasta_fn)
-		fai_destroy(fai);
-err6:
-	bam_hdr_destroy(bam_hdr);
 err5:
-	sam_close(bam_fp);
+	pthread_mutex_lock(&srv.lock);
+	srv.stop = 1;
+	pthread_cond_broadcast(&srv.cond);
+	pthread_mutex_unlock(&srv.lock);
+	for (i=0; i<n_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
 err4:
-	free(lhist_cond);
+	pthread_cond_destroy(&srv.cond);
+	pthread_mutex_destroy(&srv.lock);
 err3:
-	free(lhist);
+	unlink(sock_fn);
 err2:
-	free(counts3);
+	close(fd);
 err1:
-	free(counts5);
+	ref_close(opt);
 err0:
 	return ret;
 }
 
+/*
+ * `condamage submit': send a job to a server, and wait for it to finish.
+ * Returns the job's exit status.
+ */
+static int
+submit(const char *sock_fn, int argc, char **argv)
+{
+	struct sockaddr_un addr;
+	char cwd[PATH_MAX], reply[16];
+	ssize_t len;
+	int fd, i;
+
+	if (strlen(sock_fn) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path is too long\n", sock_fn);
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sock_fn);
+
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		fprintf(stderr, "getcwd: %s\n", strerror(errno));
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "%s: couldn't connect to server: %s\n", sock_fn, strerror(errno));
+		goto err;
+	}
+
+	if (write_all(fd, cwd, strlen(cwd)+1) < 0)
+		goto err_io;
+	for (i=0; i<argc; i++) {
+		if (write_all(fd, argv[i], strlen(argv[i])+1) < 0)
+			goto err_io;
+	}
+	if (shutdown(fd, SHUT_WR) < 0)
+		goto err_io;
+
+	len = read_all(fd, reply, sizeof(reply)-1);
+	if (len <= 0)
+		goto err_io;
+	reply[len] = '\0';
+	close(fd);
+
+	i = atoi(reply);
+	if (i != 0)
+		fprintf(stderr, "%s: job failed, see the server's log\n", sock_fn);
+	return i;
+err_io:
+	fprintf(stderr, "%s: lost connection to server\n", sock_fn);
+err:
+	if (fd >= 0)
+		close(fd);
+	return 1;
+}
+
+/*
+ * `condamage batch' scans many inputs against the same reference,
+ * opt->njobs at a time, sharing the reference between them.  The results
+ * for in.bam go to in.bam.condamage.txt, unless a manifest names another
+ * file.
+ */
+typedef struct {
+	char *bam_fn, *out_fn;
+} batch_job_t;
+
+typedef struct {
+	opt_t *opt;
+	batch_job_t *jobs;
+	int n_jobs, m_jobs;
+	int next, n_failed;
+	damage_t *sum; // add up the inputs, rather than writing their results
+	pthread_mutex_t lock;
+} batch_list_t;
+
+static int
+batch_add(batch_list_t *bl, const char *bam_fn, const char *out_fn)
+{
+	batch_job_t *job;
+
+	if (bl->n_jobs == bl->m_jobs) {
+		int m = bl->m_jobs ? bl->m_jobs*2 : 64;
+		batch_job_t *tmp = realloc(bl->jobs, m * sizeof(*tmp));
+		if (tmp == NULL)
+			goto err;
+		bl->jobs = tmp;
+		bl->m_jobs = m;
+	}
+
+	job = &bl->jobs[bl->n_jobs];
+	job->bam_fn = strdup(bam_fn);
+	if (out_fn) {
+		job->out_fn = strdup(out_fn);
+	} else if ((job->out_fn = malloc(strlen(bam_fn) + sizeof(".condamage.txt")))) {
+		sprintf(job->out_fn, "%s.condamage.txt", bam_fn);
+	}
+	if (job->bam_fn == NULL || job->out_fn == NULL) {
+		free(job->bam_fn);
+		free(job->out_fn);
+		goto err;
+	}
+	bl->n_jobs++;
+	return 0;
+err:
+	fprintf(stderr, "batch_add: failed to allocate memory\n");
+	return -1;
+}
+
+/*
+ * Add the inputs listed in the manifest fn.  Each line has an input
+ * filename, optionally followed by a tab and the output filename.
+ * Blank lines, and lines starting with #, are ignored.
+ */
+static int
+batch_read_manifest(batch_list_t *bl, const char *fn)
+{
+	char *line = NULL, *out_fn;
+	size_t m_line = 0;
+	ssize_t len;
+	FILE *fp;
+	int ret = 0;
+
+	fp = fopen(fn, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "%s: %s\n", fn, strerror(errno));
+		return -1;
+	}
+
+	while ((len = getline(&line, &m_line, fp)) > 0) {
+		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+			line[--len] = '\0';
+		if (len == 0 || line[0] == '#')
+			continue;
+		out_fn = strchr(line, '\t');
+		if (out_fn)
+			*out_fn++ = '\0';
+		if (batch_add(bl, line, out_fn) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	if (ferror(fp)) {
+		fprintf(stderr, "%s: read failed\n", fn);
+		ret = -1;
+	}
+
+	free(line);
+	fclose(fp);
+	return ret;
+}
+
+static void *
+batch_worker(void *arg)
+{
+	batch_list_t *bl = arg;
+	damage_t dmg;
+	opt_t opt;
+	int i, ret;
+
+	for (;;) {
+		pthread_mutex_lock(&bl->lock);
+		// a failed input spoils the sum, so don't start any more
+		i = bl->sum && bl->n_failed ? bl->n_jobs : bl->next++;
+		pthread_mutex_unlock(&bl->lock);
+		if (i >= bl->n_jobs)
+			break;
+
+		opt = *bl->opt;
+		opt.bam_fn = bl->jobs[i].bam_fn;
+		if (bl->sum) {
+			ret = damage_init(&dmg, &opt);
+			if (ret == 0) {
+				ret = scan_input(&opt, &dmg);
+				if (ret == 0) {
+					pthread_mutex_lock(&bl->lock);
+					damage_add(bl->sum, &dmg, &opt);
+					pthread_mutex_unlock(&bl->lock);
+				}
+				damage_free(&dmg);
+			}
+		} else {
+			ret = run_job(&opt, bl->jobs[i].out_fn);
+		}
+
+		if (ret < 0) {
+			fprintf(stderr, "%s: failed\n", opt.bam_fn);
+			pthread_mutex_lock(&bl->lock);
+			bl->n_failed++;
+			pthread_mutex_unlock(&bl->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Make the list of inputs from argv.  An argument @FILE is read as a
+ * manifest.
+ */
+static int
+batch_init(batch_list_t *bl, opt_t *opt, int argc, char **argv)
+{
+	int i;
+
+	memset(bl, 0, sizeof(*bl));
+	bl->opt = opt;
+	pthread_mutex_init(&bl->lock, NULL);
+
+	for (i=0; i<argc; i++) {
+		if (argv[i][0] == '@') {
+			if (batch_read_manifest(bl, argv[i]+1) < 0)
+				return -1;
+		} else if (batch_add(bl, argv[i], NULL) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
 static void
-usage(const opt_t *opt)
+batch_destroy(batch_list_t *bl)
 {
-	fprintf(stderr, "condamage v%s\n", CONDAMAGE_VERSION);
-	fprintf(stderr, "usage: %s [...] in.bam ref.fasta\n", opt->argv[0]);
-	fprintf(stderr, "\n");
-	fprintf(stderr, "  -w INT       Size of the region for which (mis)matches are recorded [%zd]\n", opt->window);
-	fprintf(stderr, "  -o FILE      BAM output filename [%s]\n", opt->bam_ofn?opt->bam_ofn:"");
-	fprintf(stderr, "\n");
-	fprintf(stderr, "  -C INT,INT   Output reads with a C->T mismatch within INT bases of terminal\n");
-	fprintf(stderr, "                position (5',3') [%d,%d]\n", opt->c5, opt->c3);
-	fprintf(stderr, "                E.g. -C 3,3 outputs reads with C->T mismatches in any of the 3 \n");
-	fprintf(stderr, "                positions at the start or end of a read.\n");
-	fprintf(stderr, "                -C 1,1 is appropriate for single stranded libaries.\n");
-	fprintf(stderr, "\n");
-	fprintf(stderr, "  -G INT,INT   Output reads with a G->A mismatch within INT bases of terminal\n");
-	fprintf(stderr, "                position (5',3') [%d,%d]\n", opt->g5, opt->g3);
-	fprintf(stderr, "                E.g. -C 3,0 -G 0,3 outputs reads with C->T mismatches in any of\n");
-	fprintf(stderr, "                the 3 positions at the start of the read, or a G->A mismatch in\n");
-	fprintf(stderr, "                any of the 3 positions at the end of the read.\n");
-	fprintf(stderr, "                -C 1,0 -G 0,1 is appropriate for double stranded libaries.\n");
-	fprintf(stderr, "\n");
-	fprintf(stderr, "  -l INT       Maximum length for fragment length histograms [%d]\n", opt->lmax);
+	int i;
 
-	//fprintf(stderr, "  -f           Only consider reads aligned to the forward (ref) strand\n");
-	//fprintf(stderr, "  -r           Only consider reads aligned to the reverse (non ref) strand\n");
-	exit(1);
+	for (i=0; i<bl->n_jobs; i++) {
+		free(bl->jobs[i].bam_fn);
+		free(bl->jobs[i].out_fn);
+	}
+	free(bl->jobs);
+	pthread_mutex_destroy(&bl->lock);
+}
+
+/*
+ * Scan the inputs on opt->njobs threads.  Returns -1 if any input fails.
+ */
+static int
+batch_run(batch_list_t *bl)
+{
+	pthread_t *threads;
+	int i, n_threads;
+
+	n_threads = get_njobs(bl->opt, bl->n_jobs);
+	threads = malloc((n_threads ? n_threads : 1) * sizeof(*threads));
+	if (threads == NULL) {
+		fprintf(stderr, "batch_run: failed to allocate memory\n");
+		return -1;
+	}
+	for (i=0; i<n_threads; i++) {
+		if (pthread_create(&threads[i], NULL, batch_worker, bl) != 0) {
+			fprintf(stderr, "pthread_create: failed to create thread\n");
+			break;
+		}
+	}
+	if (i == 0)
+		batch_worker(bl);
+	n_threads = i;
+	for (i=0; i<n_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	if (bl->n_failed) {
+		fprintf(stderr, "%d of %d inputs failed\n", bl->n_failed, bl->n_jobs);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * `condamage batch': scan the inputs in argv, each to its own results file.
+ */
+static int
+batch(opt_t *opt, int argc, char **argv)
+{
+	batch_list_t bl;
+	int ret = -1;
+
+	if (batch_init(&bl, opt, argc, argv) < 0)
+		goto err0;
+	if (ref_open(opt) < 0)
+		goto err0;
+	ret = batch_run(&bl);
+	ref_close(opt);
+err0:
+	batch_destroy(&bl);
+	return ret;
+}
+
+/*
+ * Scan several inputs from the same sample, such as one per lane or
+ * library, and write the sum of their damage patterns to out_fp.  This
+ * gives the same result as scanning the merged inputs, without writing
+ * them out.  The reference must already be open, see ref_open().
+ */
+static int
+aggregate(opt_t *opt, int argc, char **argv, FILE *out_fp)
+{
+	batch_list_t bl;
+	damage_t sum;
+	int ret = -1;
+
+	if (batch_init(&bl, opt, argc, argv) < 0)
+		goto err0;
+	if (damage_init(&sum, opt) < 0)
+		goto err0;
+	bl.sum = &sum;
+	ret = batch_run(&bl);
+	if (ret == 0 && damage_print(opt, &sum, out_fp) < 0)
+		ret = -1;
+	damage_free(&sum);
+err0:
+	batch_destroy(&bl);
+	return ret;
+}
+
+/*
+ * Is fn a (possibly compressed) fasta file, rather than an alignment file?
+ */
+static int
+is_fasta(const char *fn)
+{
+	htsFormat fmt;
+	hFILE *hf;
+	int ret;
+
+	hf = hopen(fn, "r");
+	if (hf == NULL)
+		return 0;
+	ret = hts_detect_format(hf, &fmt) == 0 && fmt.format == fasta_format;
+	hclose(hf);
+	return ret;
 }
 
 int
 main(int argc, char **argv)
 {
 	opt_t opt;
-	int c;
+	int i, n_in, ret;
 
-	memset(&opt, 0, sizeof(opt_t));
-	opt.window = 30;
-	opt.lmax = 1024;
-	opt.argc = argc;
-	opt.argv = argv;
+	opt_init(&opt, argc, argv);
 
-	while ((c = getopt(argc, argv, "w:o:C:G:fr")) != -1) {
-		switch (c) {
-			case 'w':
-				{
-					unsigned long w = strtoul(optarg, NULL, 0);
-					if (w < 0 || w > 100) {
-						fprintf(stderr, "-w `%s' is invalid\n", optarg);
-						usage(&opt);
-					}
-					opt.window = w;
-				}
-				break;
-			case 'o':
-				opt.bam_ofn = optarg;
-				break;
-			case 'l':
-				{
-					unsigned long l = strtoul(optarg, NULL, 0);
-					if (l < 100 || l > 1024*1024) {
-						fprintf(stderr, "-l `%s' is invalid\n", optarg);
-						usage(&opt);
-					}
-					opt.lmax = l;
-				}
-				break;
-			case 'f':
-				opt.fwd_only = 1;
-				break;
-			case 'r':
-				opt.rev_only = 1;
-				break;
-			case 'C':
-				{
-					char *tmp;
-					unsigned long x1, x2;
-					x1 = strtoul(optarg, &tmp, 0);
-					if (x1 < 0 || x1 > 100 || tmp[0] != ',') {
-						fprintf(stderr, "-C `%s' is invalid\n", optarg);
-						usage(&opt);
-					}
+	if (argc > 1 && strcmp(argv[1], "index") == 0) {
+		if (argc != 3)
+			usage(&opt);
+		return c2b_write(argv[2]) < 0 ? 1 : 0;
+	}
 
-					x2 = strtoul(tmp+1, NULL, 0);
-					if (x2 < 0 || x2 > 100) {
-						fprintf(stderr, "-C `%s' is invalid\n", optarg);
-						usage(&opt);
-					}
+	if (argc > 1 && strcmp(argv[1], "submit") == 0) {
+		if (argc < 5)
+			usage(&opt);
+		return submit(argv[2], argc-3, argv+3);
+	}
 
-					opt.c5 = x1;
-					opt.c3 = x2;
-				}
-				break;
-			case 'G':
-				{
-					char *tmp;
-					unsigned long x1, x2;
-					x1 = strtoul(optarg, &tmp, 0);
-					if (x1 < 0 || x1 > 100 || tmp[0] != ',') {
-						fprintf(stderr, "-G `%s' is invalid\n", optarg);
-						usage(&opt);
-					}
+	classify_init();
 
-					x2 = strtoul(tmp+1, NULL, 0);
-					if (x2 < 0 || x2 > 100) {
-						fprintf(stderr, "-G `%s' is invalid\n", optarg);
-						usage(&opt);
-					}
+	if (argc > 1 && strcmp(argv[1], "serve") == 0) {
+		i = parse_args(&opt, argc-1, argv+1);
+		if (i < 0 || argc-1-i != 2)
+			usage(&opt);
+		opt.fasta_fn = argv[1+i+1];
+		return serve(&opt, argv[1+i]) < 0;
+	}
 
-					opt.g5 = x1;
-					opt.g3 = x2;
-				}
-				break;
-			default:
-				usage(&opt);
+	if (argc > 1 && strcmp(argv[1], "batch") == 0) {
+		i = parse_args(&opt, argc-1, argv+1);
+		if (i < 0 || argc-1-i < 2)
+			usage(&opt);
+		if (opt.bam_ofn) {
+			fprintf(stderr, "-o can't be used with `batch'\n");
+			usage(&opt);
 		}
+		opt.fasta_fn = argv[1+i];
+		return batch(&opt, argc-1-i-1, argv+1+i+1) < 0;
 	}
 
-	int cgsum = opt.c5+opt.c3+opt.g5+opt.g3;
-	if (cgsum && opt.bam_ofn == NULL) {
-		fprintf(stderr, "-C/-G specified, but no -o FILE given\n");
-		usage(&opt);
-	}
-	if (opt.bam_ofn && cgsum == 0) {
-		fprintf(stderr, "-o FILE specified, but no -C/-G\n");
+	i = parse_args(&opt, argc, argv);
+	if (i < 0)
 		usage(&opt);
-	}
 
-	if (opt.fwd_only && opt.rev_only) {
-		fprintf(stderr, "-f and -r flags are mutually incompatible\n");
+	// in.bam ... ref.fasta, where ref.fasta is optional with -m,
+	// so then the last argument is only the reference if it's a fasta
+	n_in = argc-i;
+	if (n_in >= 2 && (!opt.use_md || is_fasta(argv[argc-1])))
+		opt.fasta_fn = argv[--n_in + i];
+	else if (!opt.use_md || n_in == 0)
 		usage(&opt);
-	}
 
-	if (argc-optind != 2) {
+	if ((n_in > 1 || argv[i][0] == '@') && opt.bam_ofn) {
+		fprintf(stderr, "-o can't be used with several inputs\n");
 		usage(&opt);
 	}
 
-	opt.bam_fn = argv[optind];
-	opt.fasta_fn = argv[optind+1];
+	if (ref_open(&opt) < 0)
+		return 1;
+	if (n_in == 1 && argv[i][0] != '@') {
+		opt.bam_fn = argv[i];
+		ret = condamage(&opt, stdout);
+	} else {
+		ret = aggregate(&opt, n_in, argv+i, stdout);
+	}
+	ref_close(&opt);
 
-	return (condamage(&opt) < 0);
+	return (ret < 0);
 }